@@ -0,0 +1,92 @@
+/**
+ * @file heap.h
+ * @brief Two-Level Segregated Fit (TLSF) heap for LunaRTOS.
+ *
+ * Dynamic allocation over the heap region reserved by the linker script
+ * (_sheap to _eheap). Free blocks are kept in size-class lists indexed by
+ * a two-level bitmap, so allocating and freeing take a bounded number of
+ * steps whatever the heap contents, and neighbouring free blocks are
+ * merged immediately. With HEAP_REPLACE_MALLOC set,
+ * malloc, free, calloc and realloc of the C library (and their reentrant
+ * variants used by stdio) are served from this heap.
+ */
+
+#ifndef __HEAP_H_
+#define __HEAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "kernel.h"
+
+// Set to 0 to keep newlib's malloc, _sbrk then grows it inside the same linker region
+#ifndef HEAP_REPLACE_MALLOC
+#define HEAP_REPLACE_MALLOC     1
+#endif
+
+// Set to 1 to build HeapBenchmark, which times malloc/free with the DWT cycle counter
+// Build once with HEAP_REPLACE_MALLOC 0 and once with 1 to compare newlib's heap to TLSF
+#ifndef HEAP_PROFILE
+#define HEAP_PROFILE            0
+#endif
+
+/**
+ * @brief Allocates a block from the heap.
+ *
+ * Runs in a bounded number of steps inside a kernel critical section, so
+ * it can be called from threads and from interrupts at or below
+ * KERNEL_MAX_SYSCALL_PRIORITY.
+ *
+ * @param size Number of bytes, the block is 8-byte aligned.
+ *
+ * @return The block, or 0 if no free block is large enough.
+ */
+void *HeapAlloc(size_t size);
+
+/**
+ * @brief Returns a block to the heap, merging it with free neighbours.
+ *
+ * @param block Block from HeapAlloc or HeapRealloc, or 0 to do nothing.
+ */
+void HeapFree(void *block);
+
+/**
+ * @brief Resizes a block.
+ *
+ * Shrinking and growing into a free neighbour happen in place, otherwise
+ * the contents are moved to a new block.
+ *
+ * @param block Block to resize, or 0 to allocate a new one.
+ * @param size New size in bytes, or 0 to free the block.
+ *
+ * @return The resized block, or 0 if there is no room (the original block
+ *         is then left untouched).
+ */
+void *HeapRealloc(void *block, size_t size);
+
+/**
+ * @brief Returns the number of free bytes in the heap.
+ *
+ * @return Bytes in free blocks, block headers not included.
+ */
+uint32_t HeapFreeBytes(void);
+
+/**
+ * @brief Returns the low-water mark of the free bytes.
+ *
+ * @return Fewest free bytes ever seen since the heap was set up.
+ */
+uint32_t HeapMinFreeBytes(void);
+
+#if HEAP_PROFILE
+/**
+ * @brief Times malloc and free over a fixed allocation pattern.
+ *
+ * Runs a repeatable mix of allocations and frees of 8 to 512 bytes
+ * through malloc/free and keeps the average and worst cycle counts in
+ * HeapAllocCyclesAvg, HeapAllocCyclesMax, HeapFreeCyclesAvg and
+ * HeapFreeCyclesMax. Call it before KernelLaunch, with interrupts quiet.
+ */
+void HeapBenchmark(void);
+#endif
+
+#endif // __HEAP_H_
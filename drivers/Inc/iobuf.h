@@ -0,0 +1,145 @@
+/**
+ * @file iobuf.h
+ * @brief Reference-counted, pool-backed I/O buffers for zero-copy data paths.
+ *
+ * An I/O buffer is a descriptor followed by its storage, both in one block
+ * of a memory pool. The payload starts after some headroom, so a protocol
+ * framer can prepend its header in place, and buffers chain into packets
+ * through their next pointer, so a header or trailer can also be linked
+ * in front of or behind a payload without moving it. Every stage, from the
+ * producer through the framers to the UART DMA driver, passes the same
+ * buffers along and the last reference returns them to their pool.
+ *
+ * As in lwIP's pbufs, the reference count belongs to the buffer and its
+ * whole tail: freeing a buffer whose count drops to zero also drops one
+ * reference on the next buffer of the chain. A buffer has one next pointer,
+ * so it can only sit in one chain; to send a shared payload behind several
+ * headers, take a reference and link it behind a separate header buffer.
+ */
+
+#ifndef __IOBUF_H_
+#define __IOBUF_H_
+
+#include <stdint.h>
+#include "kernel.h"
+
+/**
+ * @brief I/O buffer descriptor, followed by its storage in the same pool block.
+ */
+typedef struct iobuf_t{
+    struct iobuf_t *next;         // Next buffer of the same packet, 0 at the end
+    struct iobuf_t *nextPacket;   // Next packet in a driver's transmit queue
+    mempool_t *pool;              // Pool the buffer returns to
+    uint8_t *data;                // First payload byte, inside the storage
+    uint16_t length;              // Payload bytes in this buffer
+    uint16_t size;                // Storage bytes after the descriptor, headroom included
+    volatile uint32_t refs;       // Owners of the buffer and of the rest of its chain
+} iobuf_t;
+
+// Declares the storage of an I/O buffer pool, count buffers of dataSize bytes each
+#define IOBUF_POOL_BUFFER(name, dataSize, count)    MEMPOOL_BUFFER(name, sizeof(iobuf_t) + (dataSize), count)
+
+/**
+ * @brief Initializes a memory pool of I/O buffers.
+ *
+ * @param pool Pointer to the pool to initialize.
+ * @param buffer Storage for the buffers (see IOBUF_POOL_BUFFER).
+ * @param dataSize Storage bytes of each buffer, headroom included, at most 65535.
+ * @param count Number of buffers in the pool.
+ */
+void IoBufPoolInit(mempool_t *pool, void *buffer, uint32_t dataSize, uint32_t count);
+
+/**
+ * @brief Allocates an empty buffer with one reference.
+ *
+ * @param pool Pool of I/O buffers to allocate from.
+ * @param headroom Bytes kept free in front of the payload for IoBufPrepend.
+ * @param timeout Ticks to wait for a free buffer, 0 to return at once, or
+ *                WAIT_FOREVER.
+ *
+ * @return The buffer, or 0 if the pool stayed empty.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+iobuf_t *IoBufAlloc(mempool_t *pool, uint32_t headroom, uint32_t timeout);
+
+/**
+ * @brief Allocates an empty buffer from an interrupt handler, without waiting.
+ *
+ * @param pool Pool of I/O buffers to allocate from.
+ * @param headroom Bytes kept free in front of the payload for IoBufPrepend.
+ *
+ * @return The buffer, or 0 if the pool is empty.
+ */
+iobuf_t *IoBufAllocFromISR(mempool_t *pool, uint32_t headroom);
+
+/**
+ * @brief Grows the payload at the front, into the headroom.
+ *
+ * @param buf Buffer to grow.
+ * @param length Number of bytes to add.
+ *
+ * @return Where to write the new bytes (the new start of the payload), or
+ *         0 if the headroom is too small.
+ */
+uint8_t *IoBufPrepend(iobuf_t *buf, uint32_t length);
+
+/**
+ * @brief Grows the payload at the back.
+ *
+ * @param buf Buffer to grow.
+ * @param length Number of bytes to add.
+ *
+ * @return Where to write the new bytes, or 0 if the storage is too small.
+ */
+uint8_t *IoBufAppend(iobuf_t *buf, uint32_t length);
+
+/**
+ * @brief Links a chain behind the last buffer of another.
+ *
+ * The reference the caller held on tail now belongs to the chain.
+ *
+ * @param head First buffer of the packet to extend.
+ * @param tail First buffer of the chain to link behind it.
+ */
+void IoBufChain(iobuf_t *head, iobuf_t *tail);
+
+/**
+ * @brief Returns the payload length of a whole chain.
+ *
+ * @param buf First buffer of the chain.
+ *
+ * @return Payload bytes of every buffer from buf to the end of the chain.
+ */
+uint32_t IoBufChainLength(iobuf_t *buf);
+
+/**
+ * @brief Takes one more reference on a buffer and the rest of its chain.
+ *
+ * @param buf Buffer to reference.
+ */
+void IoBufRef(iobuf_t *buf);
+
+/**
+ * @brief Drops a reference on a chain.
+ *
+ * Buffers left without any reference return to their pool, walking down
+ * the chain until a buffer that is still referenced elsewhere.
+ *
+ * @param buf First buffer of the chain, or 0 to do nothing.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+void IoBufFree(iobuf_t *buf);
+
+/**
+ * @brief Drops a reference on a chain from an interrupt handler.
+ *
+ * See SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param buf First buffer of the chain, or 0 to do nothing.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ */
+void IoBufFreeFromISR(iobuf_t *buf, uint8_t *woken);
+
+#endif // __IOBUF_H_
@@ -13,7 +13,258 @@
 #include <stdint.h>
 #include "stm32f446xx.h"
 
-#define PERIOD      100
+/**
+ * @brief Thread Control Block (TCB).
+ *
+ * Opaque handle to a thread, returned by ThreadCreate.
+ */
+typedef struct tcb_t tcb_t;
+
+/**
+ * @brief Queue of threads blocked on a kernel object.
+ *
+ * Waiters are kept in priority order, FIFO among equal priorities.
+ */
+typedef struct{
+    tcb_t *head;              // Highest priority waiter, 0 when empty
+} waitqueue_t;
+
+/**
+ * @brief Counting semaphore kernel object.
+ *
+ * The count is updated with exclusive loads and stores. A positive count
+ * is the number of available units, a negative one the number of threads
+ * waiting for a unit. Give and wait only enter the kernel when a thread
+ * has to be woken or blocked.
+ */
+typedef struct{
+    volatile int32_t count;   // Available units, or minus the number of waiters
+    uint32_t wakeups;         // Units given to waiters that had not blocked yet
+    waitqueue_t waiters;      // Threads blocked in SemaphoreWait
+} semaphore_t;
+
+/**
+ * @brief Mutex kernel object with priority inheritance or an immediate
+ * priority ceiling.
+ *
+ * The lock word holds the owner's TCB address, with bit 0 set while
+ * threads are blocked on the mutex, or 0 when the mutex is free. Locking
+ * a free inheritance mutex and unlocking one nobody waits on are a single
+ * exclusive store and never enter the kernel.
+ */
+typedef struct mutex_t{
+    volatile uint32_t lock;   // Owner TCB address | contended bit, 0 when free
+    uint32_t count;           // Recursion depth of the owner
+    waitqueue_t waiters;      // Threads blocked in MutexLock
+    struct mutex_t *nextHeld; // Next contended or ceiling mutex held by the same owner
+    struct mutex_t *nextOwned; // Next mutex owned by the same thread, contended or not
+    uint8_t ceiling;          // Priority ceiling, MUTEX_NO_CEILING for priority inheritance
+} mutex_t;
+
+// Ceiling of a mutex that uses priority inheritance
+#define MUTEX_NO_CEILING    0xFF
+
+/**
+ * @brief Event group kernel object.
+ *
+ * 32 event flags that threads can wait on in combination, any or all of
+ * a set of flags.
+ */
+typedef struct{
+    uint32_t flags;           // Current event flags
+    waitqueue_t waiters;      // Threads blocked in EventGroupWait
+} eventgroup_t;
+
+// Options of EventGroupWait, combined with |
+#define EVENT_WAIT_ANY      0   // Return when any of the flags is set
+#define EVENT_WAIT_ALL      1   // Return when all of the flags are set
+#define EVENT_CLEAR         2   // Clear the flags waited for on return
+
+/**
+ * @brief Fixed-size message queue kernel object.
+ *
+ * A FIFO ring of capacity messages of itemSize bytes each, over a buffer
+ * supplied by the caller (see MSGQUEUE_BUFFER). Messages are copied in
+ * and out, a sender finding a blocked receiver copies its message
+ * straight into the receiver's buffer without going through the ring.
+ */
+typedef struct{
+    uint8_t *buffer;          // Ring storage, capacity * itemSize bytes
+    uint32_t itemSize;        // Size of one message in bytes
+    uint32_t capacity;        // Number of messages the ring holds
+    uint32_t count;           // Messages in the ring
+    uint32_t head;            // Index of the oldest message
+    uint32_t tail;            // Index the next message is written to
+    waitqueue_t receivers;    // Threads blocked in MsgQueueReceive, the ring is empty
+    waitqueue_t senders;      // Threads blocked in MsgQueueSend, the ring is full
+} msgqueue_t;
+
+// Declares the storage of a message queue, suitably aligned for any message type
+#define MSGQUEUE_BUFFER(name, itemSize, capacity)   static uint8_t name[(itemSize) * (capacity)] __attribute__((aligned(8)))
+
+/**
+ * @brief Lock-free multi-producer/multi-consumer bounded queue.
+ *
+ * A ring of capacity slots, each holding a sequence number followed by
+ * one item of itemSize bytes (see MPMCQUEUE_BUFFER). Producers and
+ * consumers claim slots by advancing their index with an exclusive store
+ * and publish them through the slot's sequence number, so sending and
+ * receiving never mask interrupts. The kernel is only entered to block a
+ * thread when the queue is full or empty, and to wake it again.
+ */
+typedef struct{
+    uint8_t *buffer;                    // Slot storage, capacity * stride bytes
+    uint32_t itemSize;                  // Size of one item in bytes
+    uint32_t stride;                    // Size of one slot in bytes, sequence number and item
+    uint32_t mask;                      // Capacity - 1, the capacity is a power of two
+    volatile uint32_t enqueuePos;       // Items claimed by producers so far
+    volatile uint32_t dequeuePos;       // Items claimed by consumers so far
+    volatile uint32_t receiversWaiting; // Threads about to block or blocked in MpmcQueueReceive
+    volatile uint32_t sendersWaiting;   // Threads about to block or blocked in MpmcQueueSend
+    waitqueue_t receivers;              // Threads blocked in MpmcQueueReceive, the queue is empty
+    waitqueue_t senders;                // Threads blocked in MpmcQueueSend, the queue is full
+} mpmcqueue_t;
+
+// Declares the storage of an MPMC queue, capacity must be a power of two, at least 2
+#define MPMCQUEUE_BUFFER(name, itemSize, capacity)  static uint32_t name[(capacity) * (1 + ((itemSize) + 3) / 4)] __attribute__((aligned(8)))
+
+/**
+ * @brief Fixed-block memory pool kernel object.
+ *
+ * blockCount blocks of blockSize bytes carved out of a static buffer
+ * (see MEMPOOL_BUFFER). Free blocks are chained through their first word,
+ * so allocating and freeing a block are O(1) and cost no memory besides
+ * the blocks themselves.
+ */
+typedef struct{
+    uint8_t *buffer;          // Block storage, blockCount * blockSize bytes
+    uint32_t blockSize;       // Size of one block in bytes, a multiple of 8
+    uint32_t blockCount;      // Number of blocks in the pool
+    void *freeList;           // First free block, each free block points to the next
+    uint32_t freeCount;       // Blocks in the free list
+    uint32_t highWater;       // Most blocks ever allocated at the same time
+    waitqueue_t waiters;      // Threads blocked in MemPoolAlloc, the pool is empty
+} mempool_t;
+
+// Size of one pool block, rounded up to keep every block 8-byte aligned
+// At least 8 bytes, a free block holds the free list link and blocks must not overlap
+#define MEMPOOL_BLOCK_SIZE(blockSize)                   ((blockSize) == 0 ? 8U : (((blockSize) + 7) & ~7U))
+
+// Declares the storage of a memory pool
+#define MEMPOOL_BUFFER(name, blockSize, blockCount)     static uint8_t name[MEMPOOL_BLOCK_SIZE(blockSize) * (blockCount)] __attribute__((aligned(8)))
+
+// Timeout of a blocking call that waits as long as it takes
+#define WAIT_FOREVER        0xFFFFFFFF
+
+// Number of priority levels, one bit per level in the 32-bit ready bitmap
+#define NUM_PRIORITIES      32
+// Priority 0 is the most urgent, NUM_PRIORITIES - 1 the least urgent
+#define LOWEST_PRIORITY     (NUM_PRIORITIES - 1)
+// Middle of the priority range, a reference point for application priorities
+#define DEFAULT_PRIORITY    (NUM_PRIORITIES / 2)
+
+// Priority level scheduled Earliest-Deadline-First
+// Threads created with ThreadCreateEDF share this level and are ordered by absolute deadline
+#ifndef EDF_PRIORITY
+#define EDF_PRIORITY        (DEFAULT_PRIORITY / 2)
+#endif
+#if EDF_PRIORITY < 1 || EDF_PRIORITY > LOWEST_PRIORITY
+#error "EDF_PRIORITY must be between 1 and LOWEST_PRIORITY (non-EDF mutex owners are capped one level above it)"
+#endif
+
+// Priority of the kernel thread that runs the periodic jobs
+#ifndef PERIODIC_PRIORITY
+#define PERIODIC_PRIORITY       0
+#endif
+
+// Size of the periodic job table
+#ifndef MAX_PERIODIC_JOBS
+#define MAX_PERIODIC_JOBS       8
+#endif
+
+// Phase argument that lets KernelAddPeriodicJob pick the phase
+#define PERIODIC_PHASE_AUTO     0xFFFFFFFF
+
+// Priority band of the rate-monotonic threads created by ThreadCreatePeriodic
+// The shortest period gets RMS_PRIORITY_HIGHEST, every longer period the next level down
+#ifndef RMS_PRIORITY_HIGHEST
+#define RMS_PRIORITY_HIGHEST    1
+#endif
+#ifndef RMS_PRIORITY_LOWEST
+#define RMS_PRIORITY_LOWEST     (EDF_PRIORITY - 1)
+#endif
+
+// Size of the static TCB pool, the maximum number of threads alive at once
+#ifndef MAX_THREADS
+#define MAX_THREADS         20
+#endif
+
+// Smallest stack accepted by ThreadCreate, in bytes
+// The initial frame is 17 words: the 8 registers stacked by the exception entry,
+// R4-R11 and the EXC_RETURN value PendSV pops. 68 bytes, rounded up to keep the
+// stack top 8-byte aligned, hence 72 rather than a round 64, which could not
+// hold the frame
+#define THREAD_MIN_STACK_SIZE   72
+
+// Declares a stack buffer of the given size in bytes, suitably aligned for ThreadCreate
+#define THREAD_STACK(name, size)    static uint32_t name[((size) + 3) / 4] __attribute__((aligned(8)))
+
+// Actions of ThreadNotify on the notification word
+#define NOTIFY_SET_BITS     0   // OR the value into the word, an event flags mailbox
+#define NOTIFY_INCREMENT    1   // Add 1 and ignore the value, a counting semaphore
+#define NOTIFY_OVERWRITE    2   // Replace the word with the value, a one-word mailbox
+
+// Set to 1 to stop the periodic tick while only the idle thread is runnable
+// The idle thread then sleeps (WFI) until the next timed kernel event
+#ifndef KERNEL_TICKLESS
+#define KERNEL_TICKLESS     0
+#endif
+
+// Set to 1 to measure the tick, context switch and semaphore cost with the DWT cycle counter
+// Results are kept in TickCycles, SwitchCycles, SwitchCyclesMax and SemaphoreCycles
+#ifndef KERNEL_PROFILE_SWITCH
+#define KERNEL_PROFILE_SWITCH   0
+#endif
+
+// Most urgent NVIC priority of an interrupt that calls the kernel
+// Kernel critical sections mask this priority and everything below it through BASEPRI,
+// interrupts with a lower number (more urgent) are never delayed by the kernel
+// but must not call any kernel function
+#ifndef KERNEL_MAX_SYSCALL_PRIORITY
+#define KERNEL_MAX_SYSCALL_PRIORITY 5
+#endif
+#if KERNEL_MAX_SYSCALL_PRIORITY < 1 || KERNEL_MAX_SYSCALL_PRIORITY > 14
+#error "KERNEL_MAX_SYSCALL_PRIORITY must be between 1 and 14 (SysTick and PendSV run at 14 and 15)"
+#endif
+
+// BASEPRI value of a kernel critical section, the priority sits in the upper bits of the byte
+#define KERNEL_BASEPRI      (KERNEL_MAX_SYSCALL_PRIORITY << (8 - __NVIC_PRIO_BITS))
+
+/**
+ * @brief Enters a kernel critical section.
+ *
+ * Raises BASEPRI to mask every interrupt at KERNEL_MAX_SYSCALL_PRIORITY
+ * or below. More urgent interrupts keep running. Critical sections nest:
+ * each call returns the mask to pass to the matching KernelExitCritical.
+ *
+ * @return The previous BASEPRI value.
+ */
+static inline uint32_t KernelEnterCritical(void){
+    uint32_t mask = __get_BASEPRI();
+    // Only ever raises the mask, so a nested call inside a stricter section changes nothing
+    __set_BASEPRI_MAX(KERNEL_BASEPRI);
+    __ISB();
+    return mask;
+}
+
+/**
+ * @brief Leaves a kernel critical section.
+ *
+ * @param mask Value returned by the matching KernelEnterCritical.
+ */
+static inline void KernelExitCritical(uint32_t mask){
+    __set_BASEPRI(mask);
+}
 
 /**
  * @brief Initializes the LunaRTOS kernel.
@@ -32,25 +283,274 @@ void KernelInit(void);
 void KernelLaunch(uint32_t quanta);
 
 /**
- * @brief Creates threads and assigns tasks to them.
+ * @brief Creates a thread and makes it ready to run.
+ *
+ * Takes a TCB from the static pool of MAX_THREADS entries and builds the
+ * thread's initial context on the caller-provided stack. The stack can be
+ * any size from THREAD_MIN_STACK_SIZE up, so small threads only cost the
+ * RAM they actually need. Threads can be created before KernelLaunch or
+ * by other threads; a new thread that outranks the caller runs at once.
+ *
+ * @param task Entry point of the thread. It receives arg as its only
+ *             parameter. If it returns, the thread is terminated and its
+ *             TCB goes back to the pool.
+ * @param arg Argument passed to task.
+ * @param priority Thread priority, 0 (highest) to LOWEST_PRIORITY, except
+ *                 EDF_PRIORITY which is reserved for ThreadCreateEDF.
+ * @param stack Stack buffer, 4-byte aligned at least (see THREAD_STACK).
+ *              It must stay valid for the lifetime of the thread.
+ * @param stackSize Size of the stack buffer in bytes.
+ *
+ * @return Handle of the new thread, or 0 if the pool is exhausted or a
+ * parameter is invalid.
+ */
+tcb_t *ThreadCreate(void (*task)(void *arg), void *arg, uint8_t priority, uint32_t *stack, uint32_t stackSize);
+
+/**
+ * @brief Creates a periodic thread scheduled Earliest-Deadline-First.
+ *
+ * EDF threads run at EDF_PRIORITY. Among them the ready thread whose
+ * current job has the earliest absolute deadline runs first, kept in a
+ * binary heap so that releases and completions cost O(log n). Fixed
+ * priority threads above EDF_PRIORITY still preempt them, the ones below
+ * only run when no EDF job is ready.
  *
- * @param task0 Pointer to the function representing the first thread's task.
- * @param task1 Pointer to the function representing the second thread's task.
- * @param task2 Pointer to the function representing the third thread's task.
+ * The first job is released at creation. Each job ends with a call to
+ * ThreadWaitNextPeriod, which blocks the thread until its next release.
  *
- * @return 0 if thread creation is successful, non-zero otherwise.
+ * @param task Entry point of the thread, receives arg.
+ * @param arg Argument passed to task.
+ * @param stack Stack buffer (see THREAD_STACK).
+ * @param stackSize Size of the stack buffer in bytes.
+ * @param period Release period in ticks.
+ * @param deadline Deadline relative to each release in ticks, at most
+ *                 the period. 0 means the deadline equals the period.
  *
- * Sets up thread control blocks (TCBs) for each task and prepares them
- * for scheduling.
+ * @return Handle of the new thread, or 0 on failure.
+ *
+ * @note EDF schedules any set of implicit-deadline threads whose total
+ * utilization (execution time / period) does not exceed 100%.
  */
-uint8_t KernelCreateThreads(void(*task0)(void), void(*task1)(void), void(*task2)(void));
+tcb_t *ThreadCreateEDF(void (*task)(void *arg), void *arg, uint32_t *stack, uint32_t stackSize, uint32_t period, uint32_t deadline);
+
+/**
+ * @brief Creates a periodic thread scheduled rate-monotonically.
+ *
+ * The thread joins the rate-monotonic task set, whose priorities are
+ * assigned from the periods: the shorter the period, the higher the
+ * priority, within RMS_PRIORITY_HIGHEST..RMS_PRIORITY_LOWEST. Threads
+ * with equal periods share a level. Existing rate-monotonic threads are
+ * re-prioritized when a new period slots in between.
+ *
+ * Creation runs an admission test on the task set including the new
+ * thread. Sets whose utilization stays under the Liu-Layland bound
+ * n(2^(1/n) - 1) are accepted directly, the others only if an exact
+ * response-time analysis shows that every job finishes within its
+ * period. The test uses integer arithmetic only.
+ *
+ * The first job is released at creation. Each job ends with a call to
+ * ThreadWaitNextPeriod.
+ *
+ * @param task Entry point of the thread, receives arg.
+ * @param arg Argument passed to task.
+ * @param stack Stack buffer (see THREAD_STACK).
+ * @param stackSize Size of the stack buffer in bytes.
+ * @param period Release period in ticks, also the relative deadline.
+ * @param wcet Worst-case execution time of one job in ticks.
+ *
+ * @return Handle of the new thread, or 0 if the task set would become
+ * unschedulable, the priority band has no room for another period, or
+ * the TCB pool is exhausted.
+ *
+ * @note Interference from fixed priority threads above the band and
+ * from interrupts is not part of the test, include it in the WCET.
+ */
+tcb_t *ThreadCreatePeriodic(void (*task)(void *arg), void *arg, uint32_t *stack, uint32_t stackSize, uint32_t period, uint32_t wcet);
+
+/**
+ * @brief Ends the current job of a periodic thread.
+ *
+ * Counts a deadline miss if the job completed after its deadline, then
+ * blocks the thread until the start of its next period. If that period
+ * has already started (overrun), the thread continues immediately.
+ * Returns at once when called from an aperiodic thread.
+ */
+void ThreadWaitNextPeriod(void);
+
+/**
+ * @brief Puts the calling thread to sleep for a number of ticks.
+ *
+ * The thread leaves the ready set and uses no CPU time until it wakes
+ * up. Sleepers are kept in a delta list (each entry stores its delay
+ * relative to the one before it), so a tick only ever counts down the
+ * first entry.
+ *
+ * @param ticks Number of ticks to sleep. 0 only yields.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+void ThreadSleep(uint32_t ticks);
+
+/**
+ * @brief Puts the calling thread to sleep until an absolute tick.
+ *
+ * Sleeping until fixed points in time (wakeTick += period) does not
+ * drift the way repeated ThreadSleep calls do.
+ *
+ * @param wakeTick Tick count (see KernelGetTicks) to wake up at. A time
+ *                 that has already passed only yields.
+ */
+void ThreadSleepUntil(uint32_t wakeTick);
+
+/**
+ * @brief Wakes a sleeping thread before its time.
+ *
+ * A thread in ThreadSleep or ThreadSleepUntil is made ready at once. If
+ * the thread is not asleep, the wakeup is remembered and its next sleep
+ * returns immediately, so a wakeup sent just before the thread goes to
+ * sleep is not lost.
+ *
+ * @param thread Handle of the thread to wake.
+ *
+ * @note A periodic thread waiting in ThreadWaitNextPeriod is released
+ * early as well.
+ */
+void ThreadWake(tcb_t *thread);
+
+/**
+ * @brief Sends a notification to a thread.
+ *
+ * Every thread has a 32-bit notification word in its TCB, so a
+ * producer can signal one consumer without a separate kernel object.
+ * The word is updated according to the action, and the thread is made
+ * ready if it waits in ThreadNotifyWait. Otherwise its next
+ * ThreadNotifyWait returns at once.
+ *
+ * @param thread Handle of the thread to notify.
+ * @param value Value used by the action.
+ * @param action NOTIFY_SET_BITS, NOTIFY_INCREMENT or NOTIFY_OVERWRITE.
+ */
+void ThreadNotify(tcb_t *thread, uint32_t value, uint8_t action);
+
+/**
+ * @brief Sends a notification to a thread from an interrupt handler.
+ *
+ * Works like ThreadNotify but never switches threads, see
+ * SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param thread Handle of the thread to notify.
+ * @param value Value used by the action.
+ * @param action NOTIFY_SET_BITS, NOTIFY_INCREMENT or NOTIFY_OVERWRITE.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ */
+void ThreadNotifyFromISR(tcb_t *thread, uint32_t value, uint8_t action, uint8_t *woken);
+
+/**
+ * @brief Waits for a notification to the calling thread.
+ *
+ * Returns at once if the thread was notified since its last call,
+ * otherwise blocks until ThreadNotify is called on it.
+ *
+ * @param clearBits Bits of the notification word to clear before
+ *                  returning, 0xFFFFFFFF to reset it.
+ *
+ * @return The notification word, before the bits were cleared.
+ */
+uint32_t ThreadNotifyWait(uint32_t clearBits);
+
+/**
+ * @brief Returns the number of deadline misses of a periodic thread.
+ *
+ * @param thread Handle of the thread.
+ *
+ * @return Number of jobs that completed after their absolute deadline.
+ */
+uint32_t ThreadGetDeadlineMisses(tcb_t *thread);
+
+/**
+ * @brief Returns the handle of the calling thread.
+ *
+ * @return Handle of the running thread.
+ */
+tcb_t *ThreadGetCurrent(void);
+
+/**
+ * @brief Registers a periodic job.
+ *
+ * The job runs every period ticks, at the ticks phase + k * period
+ * counted from KernelLaunch. The count does not wrap at 2^32 like
+ * KernelGetTicks, as long as the least common multiple of the job
+ * periods fits in 32 bits. Jobs
+ * run one after another in a kernel thread at PERIODIC_PRIORITY, not in
+ * the tick interrupt, so they can use the full kernel API and do not add
+ * to the interrupt latency. The tick only checks the earliest due time.
+ *
+ * @param job Callback to run.
+ * @param period Period in ticks.
+ * @param phase Offset in ticks, reduced modulo the period. Pass
+ *              PERIODIC_PHASE_AUTO to pick the phase that makes the job
+ *              coincide with the fewest registered jobs, so that harmonic
+ *              jobs do not all pile up on the same tick.
+ *
+ * @return 1 if the job was added, 0 if the table is full or a parameter
+ * is invalid.
+ *
+ * @note Jobs share the dispatcher's stack (PERIODIC_STACK_SIZE) and
+ * should return quickly. A job that overruns its period skips the runs
+ * it missed.
+ */
+uint8_t KernelAddPeriodicJob(void (*job)(void), uint32_t period, uint32_t phase);
+
+/**
+ * @brief Requests a context switch on exit from an interrupt handler.
+ *
+ * Call it last in a handler that used FromISR functions, with the flag
+ * they set. The switch is done by PendSV once every nested interrupt
+ * has returned.
+ *
+ * @param woken Nonzero if a FromISR call woke a thread that should run.
+ */
+void KernelYieldFromISR(uint8_t woken);
+
+/**
+ * @brief Returns the number of kernel ticks since KernelLaunch.
+ *
+ * One tick lasts one quanta as passed to KernelLaunch.
+ *
+ * @return The current tick count, wrapping at 2^32.
+ */
+uint32_t KernelGetTicks(void);
+
+/**
+ * @brief Changes the scheduling priority of a thread.
+ *
+ * The scheduler always runs the ready thread with the highest priority
+ * (lowest number). Threads that share a priority level are scheduled
+ * round-robin, one quanta each. A thread starts at the priority passed to
+ * ThreadCreate, at EDF_PRIORITY from ThreadCreateEDF, or at its
+ * rate-monotonic rank from ThreadCreatePeriodic.
+ * While the thread holds a mutex that a more urgent thread waits on, it
+ * keeps the inherited priority until it unlocks the mutex.
+ *
+ * @param thread Handle returned by ThreadCreate.
+ * @param priority New priority, 0 (highest) to LOWEST_PRIORITY. The call
+ *                 is ignored and the old priority kept for EDF_PRIORITY,
+ *                 which is reserved for ThreadCreateEDF, and for threads
+ *                 created with ThreadCreateEDF.
+ *
+ * @note A higher priority thread that never blocks starves every thread
+ * below it. If the change lets another thread outrank the caller, the
+ * switch happens before this function returns.
+ */
+void ThreadSetPriority(tcb_t *thread, uint8_t priority);
 
 /**
  * @brief Voluntarily yields the processor to allow other threads to execute.
  *
  * This function is used by the currently running thread to voluntarily
  * yield its execution time, giving the scheduler an opportunity to
- * select another thread to run. It is typically invoked when the
+ * select another thread to run. The thread moves behind the other ready
+ * threads of its priority and the switch is carried out by PendSV. It is typically invoked when the
  * current thread has completed its work and can wait until its
  * next scheduling cycle.
  *
@@ -83,66 +583,440 @@ void TIM2_1Hz_Interrupt_Init(void);
  * @brief Initializes a semaphore with a given initial value.
  *
  * This function sets up a semaphore by assigning an initial value
- * to it. The semaphore can be used for synchronization between
- * tasks in a multitasking environment.
+ * to it and emptying its wait queue. The semaphore can be used for
+ * synchronization between tasks in a multitasking environment.
  *
- * @param semaphore Pointer to the semaphore variable to initialize.
+ * @param semaphore Pointer to the semaphore to initialize.
  * @param value Initial value to assign to the semaphore. Typically,
  *              a binary semaphore is initialized to 0 or 1, while
  *              counting semaphores can have higher values.
  *
- * @note Ensure the semaphore variable is properly allocated before
- * calling this function. Incorrect initialization may lead to
- * unpredictable behavior.
+ * @note Initialize a semaphore before any thread waits on it.
  */
-void SemaphoreInit(int32_t *semaphore, int32_t value);
+void SemaphoreInit(semaphore_t *semaphore, int32_t value);
 
 /**
  * @brief Decrements (waits on) a semaphore.
  *
- * This function blocks the calling task if the semaphore value is
- * zero or less. If the semaphore value is positive, it decrements
- * the semaphore and allows the task to proceed.
+ * If the semaphore value is positive, it is decremented and the task
+ * proceeds without entering the kernel. Otherwise the calling thread is
+ * removed from the ready set and parked in the semaphore's wait queue,
+ * using no CPU time until SemaphoreGive hands it a unit.
  *
- * @param semaphore Pointer to the semaphore variable to wait on.
+ * @param semaphore Pointer to the semaphore to wait on.
  *
- * @note This function assumes atomic operations for manipulating
- * the semaphore value to avoid race conditions. It should only be
- * used in environments with proper mutual exclusion mechanisms.
+ * @note Must only be called from a thread, never from an interrupt.
  */
-void SemaphoreWait(int32_t *semaphore);
+void SemaphoreWait(semaphore_t *semaphore);
 
 /**
  * @brief Increments (gives) a semaphore.
  *
- * This function increments the value of a semaphore, potentially
- * unblocking a task that is waiting on the semaphore. It is used
- * to signal the availability of a resource or completion of a task.
+ * If threads are waiting, the unit is handed directly to the highest
+ * priority waiter (FIFO among equal priorities), which is made ready and
+ * preempts the caller if it has a higher priority. Otherwise the value
+ * of the semaphore is incremented, without entering the kernel.
  *
- * @param semaphore Pointer to the semaphore variable to increment.
+ * @param semaphore Pointer to the semaphore to increment.
  *
  * @note Ensure this function is called only after the semaphore
  * has been initialized. Misuse may result in undefined behavior.
  */
-void SemaphoreGive(int32_t *semaphore);
+void SemaphoreGive(semaphore_t *semaphore);
+
+/**
+ * @brief Gives a semaphore from an interrupt handler.
+ *
+ * Works like SemaphoreGive but never switches threads. If the unit went
+ * to a thread that outranks the interrupted one, *woken is set to 1.
+ * The handler passes the flag to KernelYieldFromISR before it returns,
+ * so waking several threads costs a single context switch.
+ *
+ * @param semaphore Pointer to the semaphore to increment.
+ * @param woken Set to 1 if a context switch is needed, left unchanged
+ *              otherwise. Initialize it to 0. Can be 0 (no pointer).
+ *
+ * @note The interrupt priority must be KERNEL_MAX_SYSCALL_PRIORITY or
+ * a higher number.
+ */
+void SemaphoreGiveFromISR(semaphore_t *semaphore, uint8_t *woken);
+
+/**
+ * @brief Initializes a mutex, unlocked.
+ *
+ * @param mutex Pointer to the mutex to initialize.
+ */
+void MutexInit(mutex_t *mutex);
+
+/**
+ * @brief Initializes an immediate priority-ceiling mutex, unlocked.
+ *
+ * MutexLock raises the caller to the ceiling as soon as it takes the
+ * mutex, and MutexUnlock restores its priority. With the ceiling above
+ * every thread that uses the mutex, no other user can run while it is
+ * held: a thread is blocked at most once, by one critical section of a
+ * lower priority thread, before it starts running (stack resource
+ * policy). Locking and unlocking always enter the kernel.
+ *
+ * @param mutex Pointer to the mutex to initialize.
+ * @param ceiling Priority of the most urgent thread that locks the
+ *                mutex, or one level above it so that round-robin peers
+ *                at that level do not run while the mutex is held.
+ *
+ * @note A user with a priority above the ceiling breaks the bound, it
+ * then blocks (with priority inheritance) like on a plain mutex.
+ */
+void MutexInitCeiling(mutex_t *mutex, uint8_t ceiling);
+
+/**
+ * @brief Locks a mutex, blocking while another thread owns it.
+ *
+ * The owner can lock the mutex again, it is released after the matching
+ * number of MutexUnlock calls. While threads are blocked on the mutex the
+ * owner runs at the priority of the most urgent of them, and so does the
+ * owner of any mutex it is blocked on in turn (transitive inheritance).
+ * A high priority thread is then only delayed by the critical sections
+ * of lower priority threads, not by medium priority work. An owner not
+ * created with ThreadCreateEDF has no deadline, when it would inherit
+ * EDF_PRIORITY it runs at EDF_PRIORITY - 1 instead.
+ *
+ * @param mutex Pointer to the mutex to lock.
+ *
+ * @note Must only be called from a thread, never from an interrupt. A
+ * thread that returns while owning mutexes releases all of them, handing
+ * each one to its highest priority waiter.
+ */
+void MutexLock(mutex_t *mutex);
+
+/**
+ * @brief Locks a mutex if that can be done without blocking.
+ *
+ * @param mutex Pointer to the mutex to lock.
+ *
+ * @return 1 if the caller now owns the mutex, 0 if another thread does.
+ */
+uint8_t MutexTryLock(mutex_t *mutex);
+
+/**
+ * @brief Unlocks a mutex owned by the calling thread.
+ *
+ * Once the recursion count drops to 0 the mutex is handed directly to
+ * the highest priority waiter, and the caller goes back to the priority
+ * it would have without this mutex. Calls from a thread that does not
+ * own the mutex are ignored.
+ *
+ * @param mutex Pointer to the mutex to unlock.
+ */
+void MutexUnlock(mutex_t *mutex);
+
+/**
+ * @brief Initializes an event group with every flag clear.
+ *
+ * @param group Pointer to the event group to initialize.
+ */
+void EventGroupInit(eventgroup_t *group);
+
+/**
+ * @brief Waits for a combination of event flags.
+ *
+ * Returns at once if the condition already holds, otherwise blocks
+ * until EventGroupSet makes it true.
+ *
+ * @param group Pointer to the event group.
+ * @param bits Flags to wait for.
+ * @param options EVENT_WAIT_ANY or EVENT_WAIT_ALL, optionally with
+ *                EVENT_CLEAR to clear the flags in bits on return.
+ *
+ * @return The flags of the group at the moment the wait was satisfied,
+ *         before the auto-clear.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+uint32_t EventGroupWait(eventgroup_t *group, uint32_t bits, uint8_t options);
+
+/**
+ * @brief Sets event flags.
+ *
+ * Every waiter whose condition now holds is woken in a single pass over
+ * the wait queue. The flags of waiters that use EVENT_CLEAR are cleared
+ * once the pass is done, so one set can release several waiters on the
+ * same flag.
+ *
+ * @param group Pointer to the event group.
+ * @param bits Flags to set.
+ *
+ * @return The flags after setting, before any auto-clear.
+ */
+uint32_t EventGroupSet(eventgroup_t *group, uint32_t bits);
+
+/**
+ * @brief Sets event flags from an interrupt handler.
+ *
+ * Works like EventGroupSet but never switches threads, see
+ * SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param group Pointer to the event group.
+ * @param bits Flags to set.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ *
+ * @return The flags after setting, before any auto-clear.
+ */
+uint32_t EventGroupSetFromISR(eventgroup_t *group, uint32_t bits, uint8_t *woken);
+
+/**
+ * @brief Clears event flags.
+ *
+ * @param group Pointer to the event group.
+ * @param bits Flags to clear.
+ *
+ * @return The flags before clearing.
+ */
+uint32_t EventGroupClear(eventgroup_t *group, uint32_t bits);
+
+/**
+ * @brief Returns the current event flags.
+ *
+ * @param group Pointer to the event group.
+ *
+ * @return The flags of the group.
+ */
+uint32_t EventGroupGet(eventgroup_t *group);
+
+/**
+ * @brief Initializes an empty message queue.
+ *
+ * @param queue Pointer to the message queue to initialize.
+ * @param buffer Storage for capacity messages (see MSGQUEUE_BUFFER).
+ * @param itemSize Size of one message in bytes.
+ * @param capacity Number of messages the queue holds, at least 1.
+ */
+void MsgQueueInit(msgqueue_t *queue, void *buffer, uint32_t itemSize, uint32_t capacity);
+
+/**
+ * @brief Sends a message, waiting for room if the queue is full.
+ *
+ * The message is copied, the caller's buffer can be reused on return.
+ * Blocked senders are served in priority order as room becomes free.
+ *
+ * @param queue Pointer to the message queue.
+ * @param item Message to send, itemSize bytes.
+ * @param timeout Ticks to wait for room, 0 to return at once, or
+ *                WAIT_FOREVER.
+ *
+ * @return 1 if the message was sent, 0 if the queue stayed full.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+uint8_t MsgQueueSend(msgqueue_t *queue, const void *item, uint32_t timeout);
+
+/**
+ * @brief Receives the oldest message, waiting for one if the queue is empty.
+ *
+ * @param queue Pointer to the message queue.
+ * @param item Buffer the message is copied to, itemSize bytes.
+ * @param timeout Ticks to wait for a message, 0 to return at once, or
+ *                WAIT_FOREVER.
+ *
+ * @return 1 if a message was received, 0 if the queue stayed empty.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+uint8_t MsgQueueReceive(msgqueue_t *queue, void *item, uint32_t timeout);
+
+/**
+ * @brief Sends a message from an interrupt handler, without waiting.
+ *
+ * See SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param queue Pointer to the message queue.
+ * @param item Message to send, itemSize bytes.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ *
+ * @return 1 if the message was sent, 0 if the queue is full.
+ */
+uint8_t MsgQueueSendFromISR(msgqueue_t *queue, const void *item, uint8_t *woken);
+
+/**
+ * @brief Receives a message from an interrupt handler, without waiting.
+ *
+ * See SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param queue Pointer to the message queue.
+ * @param item Buffer the message is copied to, itemSize bytes.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ *
+ * @return 1 if a message was received, 0 if the queue is empty.
+ */
+uint8_t MsgQueueReceiveFromISR(msgqueue_t *queue, void *item, uint8_t *woken);
+
+/**
+ * @brief Returns the number of messages waiting in a queue.
+ *
+ * @param queue Pointer to the message queue.
+ *
+ * @return Messages in the queue.
+ */
+uint32_t MsgQueueCount(msgqueue_t *queue);
+
+/**
+ * @brief Initializes an empty MPMC queue.
+ *
+ * @param queue Pointer to the queue to initialize.
+ * @param buffer Storage for the slots (see MPMCQUEUE_BUFFER).
+ * @param itemSize Size of one item in bytes.
+ * @param capacity Number of items the queue holds, rounded down to a
+ *                 power of two, at least 2.
+ *
+ * @return 1 on success, 0 if capacity is below 2 and the queue must not
+ *         be used.
+ */
+uint8_t MpmcQueueInit(mpmcqueue_t *queue, void *buffer, uint32_t itemSize, uint32_t capacity);
+
+/**
+ * @brief Sends an item, waiting for room if the queue is full.
+ *
+ * The item is copied in without masking interrupts. A thread preempted
+ * between claiming a slot and filling it holds up the consumers of that
+ * slot only, until it runs again.
+ *
+ * @param queue Pointer to the queue.
+ * @param item Item to send, itemSize bytes.
+ * @param timeout Ticks to wait for room, 0 to return at once, or
+ *                WAIT_FOREVER.
+ *
+ * @return 1 if the item was sent, 0 if the queue stayed full.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+uint8_t MpmcQueueSend(mpmcqueue_t *queue, const void *item, uint32_t timeout);
+
+/**
+ * @brief Receives the oldest item, waiting for one if the queue is empty.
+ *
+ * @param queue Pointer to the queue.
+ * @param item Buffer the item is copied to, itemSize bytes.
+ * @param timeout Ticks to wait for an item, 0 to return at once, or
+ *                WAIT_FOREVER.
+ *
+ * @return 1 if an item was received, 0 if the queue stayed empty.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+uint8_t MpmcQueueReceive(mpmcqueue_t *queue, void *item, uint32_t timeout);
+
+/**
+ * @brief Sends an item from an interrupt handler, without waiting.
+ *
+ * See SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param queue Pointer to the queue.
+ * @param item Item to send, itemSize bytes.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ *
+ * @return 1 if the item was sent, 0 if the queue is full.
+ */
+uint8_t MpmcQueueSendFromISR(mpmcqueue_t *queue, const void *item, uint8_t *woken);
+
+/**
+ * @brief Receives an item from an interrupt handler, without waiting.
+ *
+ * See SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param queue Pointer to the queue.
+ * @param item Buffer the item is copied to, itemSize bytes.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ *
+ * @return 1 if an item was received, 0 if the queue is empty.
+ */
+uint8_t MpmcQueueReceiveFromISR(mpmcqueue_t *queue, void *item, uint8_t *woken);
+
+/**
+ * @brief Returns the number of items in an MPMC queue.
+ *
+ * The count is a snapshot, other threads may change it at any time.
+ *
+ * @param queue Pointer to the queue.
+ *
+ * @return Items claimed by producers and not yet by consumers.
+ */
+uint32_t MpmcQueueCount(mpmcqueue_t *queue);
+
+/**
+ * @brief Initializes a memory pool with every block free.
+ *
+ * @param pool Pointer to the pool to initialize.
+ * @param buffer Storage for the blocks (see MEMPOOL_BUFFER), 8-byte aligned.
+ * @param blockSize Size of one block in bytes, rounded up to a multiple of 8,
+ *                  at least 8.
+ * @param blockCount Number of blocks in the pool, 0 leaves it empty for good.
+ */
+void MemPoolInit(mempool_t *pool, void *buffer, uint32_t blockSize, uint32_t blockCount);
+
+/**
+ * @brief Allocates a block, waiting for one if the pool is empty.
+ *
+ * Blocked threads are served in priority order, a freed block is handed
+ * straight to the highest priority one.
+ *
+ * @param pool Pointer to the pool.
+ * @param timeout Ticks to wait for a block, 0 to return at once, or
+ *                WAIT_FOREVER.
+ *
+ * @return The block, or 0 if the pool stayed empty.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+void *MemPoolAlloc(mempool_t *pool, uint32_t timeout);
+
+/**
+ * @brief Allocates a block from an interrupt handler, without waiting.
+ *
+ * @param pool Pointer to the pool.
+ *
+ * @return The block, or 0 if the pool is empty.
+ */
+void *MemPoolAllocFromISR(mempool_t *pool);
+
+/**
+ * @brief Returns a block to its pool.
+ *
+ * @param pool Pointer to the pool the block was allocated from.
+ * @param block Block to free.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+void MemPoolFree(mempool_t *pool, void *block);
+
+/**
+ * @brief Returns a block to its pool from an interrupt handler.
+ *
+ * See SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param pool Pointer to the pool the block was allocated from.
+ * @param block Block to free.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ */
+void MemPoolFreeFromISR(mempool_t *pool, void *block, uint8_t *woken);
+
+/**
+ * @brief Returns the number of free blocks in a pool.
+ *
+ * @param pool Pointer to the pool.
+ *
+ * @return Blocks available without waiting.
+ */
+uint32_t MemPoolFreeCount(mempool_t *pool);
 
 /**
- * @brief A sample task for testing round-robin scheduling in the RTOS.
+ * @brief Returns the high-water mark of a pool.
  *
- * This function represents the third task in the system and is primarily
- * used to validate the round-robin scheduling functionality of the RTOS.
- * It performs a simple operation, such as incrementing a variable in order
- * to demonstrate task switching between multiple threads.
+ * Used to size pools: a high-water mark well below blockCount over a
+ * representative run means the pool can shrink.
  *
- * @details The behavior of this task should be observable to confirm
- * proper context switching and equal time allocation among tasks in
- * a round-robin scheduling algorithm. This task will be defined in
- * main.c
+ * @param pool Pointer to the pool.
  *
- * @note Ensure that task3 is created and added to the scheduler's
- * task list before testing. The task should be designed to complete
- * within the time slice allocated by the RTOS.
+ * @return Most blocks ever allocated at the same time since MemPoolInit.
  */
-void task3(void);
+uint32_t MemPoolHighWater(mempool_t *pool);
 
 #endif // __KERNEL_H_
@@ -0,0 +1,112 @@
+/**
+ * @file ringbuf.h
+ * @brief Lock-free single-producer/single-consumer byte ring.
+ *
+ * One producer (typically an interrupt handler) and one consumer thread
+ * share the ring without masking interrupts or entering the kernel. The
+ * producer reserves contiguous space and writes in place, then commits
+ * any number of bytes at once. The consumer reads in place and releases
+ * what it is done with. Only the producer writes the head index and only
+ * the consumer writes the tail index, DMB barriers order the data
+ * accesses against the index updates.
+ */
+
+#ifndef __RINGBUF_H_
+#define __RINGBUF_H_
+
+#include <stdint.h>
+#include "stm32f446xx.h"
+
+// Declares the storage of a ring, size must be a power of two
+#define RING_BUFFER(name, size)     static uint8_t name[size] __attribute__((aligned(8)))
+
+/**
+ * @brief SPSC ring buffer.
+ *
+ * The indices run freely and wrap at 2^32, their difference is the
+ * number of bytes in the ring.
+ */
+typedef struct{
+    uint8_t *buffer;              // Storage, size bytes
+    uint32_t size;                // Capacity in bytes, a power of two
+    volatile uint32_t head;       // Bytes committed so far, written by the producer only
+    volatile uint32_t tail;       // Bytes released so far, written by the consumer only
+    void (*notify)(void *arg);    // Called by the producer when the ring stops being empty
+    void *arg;                    // Argument passed to notify
+} ringbuf_t;
+
+/**
+ * @brief Initializes an empty ring.
+ *
+ * @param ring Pointer to the ring to initialize.
+ * @param buffer Storage for the ring (see RING_BUFFER).
+ * @param size Size of the storage in bytes, rounded down to a power of two.
+ * @param notify Function the producer calls when a commit makes the
+ *               empty ring non-empty, typically waking the consumer
+ *               (ThreadNotifyFromISR). Can be 0.
+ * @param arg Argument passed to notify.
+ */
+void RingInit(ringbuf_t *ring, uint8_t *buffer, uint32_t size, void (*notify)(void *arg), void *arg);
+
+/**
+ * @brief Reserves contiguous free space for the producer.
+ *
+ * The space stops at the end of the storage, a producer that needs more
+ * commits what it wrote and reserves again from the start.
+ *
+ * @param ring Pointer to the ring.
+ * @param length Set to the number of contiguous free bytes, 0 if the
+ *               ring is full.
+ *
+ * @return Where to write the data, valid until RingCommit.
+ *
+ * @note Producer side only.
+ */
+uint8_t *RingReserve(ringbuf_t *ring, uint32_t *length);
+
+/**
+ * @brief Publishes bytes written in reserved space to the consumer.
+ *
+ * Calls the notify hook if the ring was empty, so a burst of commits
+ * wakes the consumer only once.
+ *
+ * @param ring Pointer to the ring.
+ * @param length Number of bytes written, at most the reserved length.
+ *
+ * @note Producer side only.
+ */
+void RingCommit(ringbuf_t *ring, uint32_t length);
+
+/**
+ * @brief Returns the contiguous data available to the consumer.
+ *
+ * @param ring Pointer to the ring.
+ * @param length Set to the number of contiguous bytes to read, 0 if the
+ *               ring is empty.
+ *
+ * @return Where to read the data, valid until RingRelease.
+ *
+ * @note Consumer side only.
+ */
+uint8_t *RingPeek(ringbuf_t *ring, uint32_t *length);
+
+/**
+ * @brief Hands bytes the consumer is done with back to the producer.
+ *
+ * @param ring Pointer to the ring.
+ * @param length Number of bytes consumed, at most the peeked length.
+ *
+ * @note Consumer side only.
+ */
+void RingRelease(ringbuf_t *ring, uint32_t length);
+
+/**
+ * @brief Returns the number of bytes in the ring.
+ *
+ * @param ring Pointer to the ring.
+ *
+ * @return Committed bytes not yet released.
+ */
+uint32_t RingCount(ringbuf_t *ring);
+
+#endif // __RINGBUF_H_
@@ -0,0 +1,96 @@
+/**
+ * @file swtimer.h
+ * @brief Software timers for the LunaRTOS kernel.
+ *
+ * One-shot and auto-reload timers kept in a hierarchical timing wheel.
+ * Starting, stopping and expiring a timer cost O(1) no matter how many
+ * timers are armed. Callbacks run in a timer-service thread, never in
+ * the SysTick interrupt.
+ */
+
+#ifndef __SWTIMER_H_
+#define __SWTIMER_H_
+
+#include <stdint.h>
+#include "kernel.h"
+
+// Priority of the timer-service thread that runs the callbacks
+#ifndef TIMER_SERVICE_PRIORITY
+#define TIMER_SERVICE_PRIORITY      0
+#endif
+
+// Stack size of the timer-service thread in bytes, callbacks run on it
+#ifndef TIMER_SERVICE_STACK_SIZE
+#define TIMER_SERVICE_STACK_SIZE    512
+#endif
+
+/**
+ * @brief Software timer.
+ *
+ * Allocated by the caller, set up with SoftTimerInit. The fields are
+ * private to the timer module.
+ */
+typedef struct swtimer_t{
+    struct swtimer_t *nextPtr;    // Next timer in the same wheel slot
+    struct swtimer_t *prevPtr;    // Previous timer in the same wheel slot
+    uint32_t expires;             // Absolute expiry tick
+    uint32_t period;              // Reload period in ticks, 0 for a one-shot timer
+    uint8_t level;                // Wheel level the timer sits in
+    uint8_t slot;                 // Slot within the level
+    uint8_t active;               // Set while the timer is armed
+    void (*callback)(void *arg);  // Function run on expiry
+    void *arg;                    // Argument passed to the callback
+} swtimer_t;
+
+/**
+ * @brief Starts the timer-service thread.
+ *
+ * Must be called once after KernelInit and before the first timer is
+ * started.
+ *
+ * @return 1 on success, 0 if the thread could not be created.
+ */
+uint8_t SoftTimerServiceInit(void);
+
+/**
+ * @brief Initializes a timer.
+ *
+ * @param timer Timer to initialize, it must not be armed.
+ * @param callback Function run in the timer-service thread on expiry.
+ * @param arg Argument passed to the callback.
+ */
+void SoftTimerInit(swtimer_t *timer, void (*callback)(void *arg), void *arg);
+
+/**
+ * @brief Arms a timer, restarting it if it is already armed.
+ *
+ * @param timer Timer to arm.
+ * @param ticks Ticks until the first expiry, at least 1.
+ * @param period Reload period in ticks for an auto-reload timer, or 0
+ *               for a one-shot timer. Reloads are counted from the
+ *               previous expiry, so an auto-reload timer does not drift.
+ *
+ * @note Can be called from threads and from timer callbacks.
+ */
+void SoftTimerStart(swtimer_t *timer, uint32_t ticks, uint32_t period);
+
+/**
+ * @brief Disarms a timer.
+ *
+ * Does nothing if the timer is not armed. A stopped timer's callback is
+ * not run, unless it has already started.
+ *
+ * @param timer Timer to disarm.
+ */
+void SoftTimerStop(swtimer_t *timer);
+
+/**
+ * @brief Tells whether a timer is armed.
+ *
+ * @param timer Timer to check.
+ *
+ * @return 1 if the timer is armed, 0 otherwise.
+ */
+uint8_t SoftTimerIsActive(swtimer_t *timer);
+
+#endif // __SWTIMER_H_
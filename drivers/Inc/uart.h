@@ -14,6 +14,7 @@
 #define __UART_H_
 
 #include "stm32f446xx.h"
+#include "iobuf.h"
 
 /**
  * @brief Transmits a single character via UART.
@@ -36,4 +37,38 @@ int __io_putchar(int character);
  */
 void uart_tx_init(void);
 
+/**
+ * @brief Queues a packet for transmission by DMA.
+ *
+ * The DMA reads every buffer of the chain in place, nothing is copied.
+ * The driver takes over the caller's reference and drops it from the DMA
+ * interrupt once the last byte of the packet has been handed to the UART,
+ * so the buffers return to their pool without the caller waiting.
+ * Characters written through __io_putchar wait until the queue has
+ * drained, so they never land in the middle of a packet.
+ *
+ * @param packet First buffer of the packet.
+ *
+ * @note Must only be called from a thread, never from an interrupt.
+ */
+void uart_send(iobuf_t *packet);
+
+/**
+ * @brief Queues a packet for transmission by DMA from an interrupt handler.
+ *
+ * Same as uart_send. See SemaphoreGiveFromISR for the woken flag.
+ *
+ * @param packet First buffer of the packet.
+ * @param woken Set to 1 if a context switch is needed. Can be 0.
+ */
+void uart_send_from_isr(iobuf_t *packet, uint8_t *woken);
+
+/**
+ * @brief DMA1 stream 6 (USART2 TX) interrupt handler.
+ *
+ * Starts the next buffer when the current one has been sent and frees
+ * the packets that are done.
+ */
+void DMA1_Stream6_IRQHandler(void);
+
 #endif /* __UART_H_ */
@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap.h"
+
+// Second level: each power-of-two size range is split into 16 linear classes
+#define HEAP_SL_LOG2		4
+#define HEAP_SL_COUNT		(1U << HEAP_SL_LOG2)
+
+// Blocks below 128 bytes all go in first level 0, in 8-byte classes
+#define HEAP_ALIGN			8
+#define HEAP_FL_SHIFT		(HEAP_SL_LOG2 + 3)
+#define HEAP_SMALL_SIZE		(1U << HEAP_FL_SHIFT)
+
+// First level: blocks up to 2^HEAP_FL_MAX bytes, more than the whole RAM
+#define HEAP_FL_MAX			18
+#define HEAP_FL_COUNT		(HEAP_FL_MAX - HEAP_FL_SHIFT + 1)
+
+// Low bit of the size word, the sizes themselves are multiples of 8
+#define BLOCK_FREE			1U
+
+/**
+ * Block header. Blocks tile the heap region in address order and end with
+ * a zero-size sentinel that is always in use, so walking to the next
+ * block never runs off the region.
+ */
+typedef struct heap_block_t{
+	struct heap_block_t *prevPhys;	// Block just below in memory, 0 for the first one
+	uint32_t size;					// Payload size in bytes | BLOCK_FREE
+	struct heap_block_t *nextFree;	// Next block in the same size class, free blocks only
+	struct heap_block_t *prevFree;	// Previous block in the same size class, free blocks only
+} heap_block_t;
+
+// Header in front of every block, the payload starts at nextFree
+#define BLOCK_OVERHEAD		offsetof(heap_block_t, nextFree)
+
+// Smallest payload, a free block must hold its list links
+#define BLOCK_MIN_SIZE		(sizeof(heap_block_t) - BLOCK_OVERHEAD)
+
+// Heap region reserved by the linker script
+extern uint8_t _sheap;
+extern uint8_t _eheap;
+
+// One bit per first level with a non-empty class, one bit per non-empty class of each first level
+static uint32_t flBitmap = 0;
+static uint32_t slBitmap[HEAP_FL_COUNT];
+
+// Free list heads of every size class
+static heap_block_t *freeLists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+
+// Set once the region has been turned into a single free block
+static uint8_t heapReady = 0;
+
+// Free payload bytes now and the fewest ever
+static uint32_t freeBytes = 0;
+static uint32_t minFreeBytes = 0;
+
+#if HEAP_PROFILE
+// Average and worst cycles of one malloc and one free in HeapBenchmark
+volatile uint32_t HeapAllocCyclesAvg = 0, HeapAllocCyclesMax = 0;
+volatile uint32_t HeapFreeCyclesAvg = 0, HeapFreeCyclesMax = 0;
+#endif
+
+static void HeapSetup(void);
+static void *HeapTake(uint32_t size);
+static void HeapRelease(heap_block_t *block);
+static void HeapTrim(heap_block_t *block, uint32_t size);
+static void HeapMapping(uint32_t size, uint32_t *fl, uint32_t *sl);
+static void FreeListInsert(heap_block_t *block);
+static void FreeListRemove(heap_block_t *block);
+
+static inline uint32_t BlockSize(heap_block_t *block){
+	return block->size & ~BLOCK_FREE;
+}
+
+static inline heap_block_t *BlockNext(heap_block_t *block){
+	return (heap_block_t *)((uint8_t *)block + BLOCK_OVERHEAD + BlockSize(block));
+}
+
+static inline heap_block_t *BlockFromPayload(void *payload){
+	return (heap_block_t *)((uint8_t *)payload - BLOCK_OVERHEAD);
+}
+
+static inline uint32_t HeapAdjust(size_t size){
+	// Round up to the alignment, and to the smallest block that can be freed again
+	size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+	return size < BLOCK_MIN_SIZE ? BLOCK_MIN_SIZE : size;
+}
+
+void *HeapAlloc(size_t size){
+	uint32_t mask;
+	void *block;
+
+	// Larger than any block can be, also keeps the rounding below from overflowing
+	if(size >= (1U << (HEAP_FL_MAX - 1))){
+		return 0;
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(!heapReady){
+		HeapSetup();
+	}
+	block = HeapTake(HeapAdjust(size));
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return block;
+}
+
+void HeapFree(void *block){
+	uint32_t mask;
+
+	if(block == 0){
+		return;
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	HeapRelease(BlockFromPayload(block));
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+void *HeapRealloc(void *block, size_t size){
+	uint32_t mask;
+	uint32_t want, current;
+	heap_block_t *header, *next;
+	void *moved;
+
+	if(block == 0){
+		return HeapAlloc(size);
+	}
+	if(size == 0){
+		HeapFree(block);
+		return 0;
+	}
+	if(size >= (1U << (HEAP_FL_MAX - 1))){
+		return 0;
+	}
+
+	want = HeapAdjust(size);
+	header = BlockFromPayload(block);
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	current = BlockSize(header);
+	next = BlockNext(header);
+	if(want > current && (next->size & BLOCK_FREE) && current + BLOCK_OVERHEAD + BlockSize(next) >= want){
+		// Grow into the free block above
+		FreeListRemove(next);
+		freeBytes -= BlockSize(next);
+		header->size += BLOCK_OVERHEAD + BlockSize(next);
+		BlockNext(header)->prevPhys = header;
+		if(freeBytes < minFreeBytes){
+			minFreeBytes = freeBytes;
+		}
+	}
+	if(want <= BlockSize(header)){
+		// Fits in place, give back the tail if it is large enough to be a block
+		HeapTrim(header, want);
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return block;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	// Move to a new block, the old one stays valid if there is no room
+	moved = HeapAlloc(size);
+	if(moved != 0){
+		memcpy(moved, block, current);
+		HeapFree(block);
+	}
+	return moved;
+}
+
+uint32_t HeapFreeBytes(void){
+	// A 32-bit aligned read is atomic on the Cortex-M4
+	return freeBytes;
+}
+
+uint32_t HeapMinFreeBytes(void){
+	// A 32-bit aligned read is atomic on the Cortex-M4
+	return minFreeBytes;
+}
+
+static void HeapSetup(void){
+	// Must be called inside a critical section
+	uintptr_t start = ((uintptr_t)&_sheap + HEAP_ALIGN - 1) & ~(uintptr_t)(HEAP_ALIGN - 1);
+	uintptr_t end = (uintptr_t)&_eheap & ~(uintptr_t)(HEAP_ALIGN - 1);
+	heap_block_t *block = (heap_block_t *)start;
+	heap_block_t *sentinel;
+
+	heapReady = 1;
+	if(end - start < 2 * BLOCK_OVERHEAD + BLOCK_MIN_SIZE){
+		// No room for a single block, every allocation fails
+		return;
+	}
+
+	// One free block over the whole region, closed by the sentinel
+	block->prevPhys = 0;
+	block->size = (end - start - 2 * BLOCK_OVERHEAD) | BLOCK_FREE;
+	sentinel = BlockNext(block);
+	sentinel->prevPhys = block;
+	sentinel->size = 0;
+	FreeListInsert(block);
+
+	freeBytes = BlockSize(block);
+	minFreeBytes = freeBytes;
+}
+
+static void *HeapTake(uint32_t size){
+	// Must be called inside a critical section
+	uint32_t fl, sl, map;
+	uint32_t rounded = size;
+	heap_block_t *block;
+
+	// Round up to the next class boundary, any block in that class or above fits
+	// without searching the list: good fit at O(1) instead of best fit
+	if(rounded >= HEAP_SMALL_SIZE){
+		rounded += (1U << (31 - __CLZ(rounded) - HEAP_SL_LOG2)) - 1;
+	}
+	HeapMapping(rounded, &fl, &sl);
+	if(fl >= HEAP_FL_COUNT){
+		return 0;
+	}
+
+	// First non-empty class at or above (fl, sl), two bitmap lookups
+	map = slBitmap[fl] & (~0U << sl);
+	if(map == 0){
+		map = flBitmap & (~0U << (fl + 1));
+		if(map == 0){
+			// Out of memory
+			return 0;
+		}
+		fl = __builtin_ctz(map);
+		map = slBitmap[fl];
+	}
+	sl = __builtin_ctz(map);
+	block = freeLists[fl][sl];
+
+	// Take the block and give back what it has beyond the request
+	FreeListRemove(block);
+	block->size &= ~BLOCK_FREE;
+	freeBytes -= BlockSize(block);
+	HeapTrim(block, size);
+	if(freeBytes < minFreeBytes){
+		minFreeBytes = freeBytes;
+	}
+
+	return (uint8_t *)block + BLOCK_OVERHEAD;
+}
+
+static void HeapRelease(heap_block_t *block){
+	// Must be called inside a critical section
+	heap_block_t *prev = block->prevPhys;
+	heap_block_t *next = BlockNext(block);
+
+	freeBytes += BlockSize(block);
+
+	// Merge with the free block below, it takes this one's place
+	if(prev != 0 && (prev->size & BLOCK_FREE)){
+		FreeListRemove(prev);
+		prev->size += BLOCK_OVERHEAD + BlockSize(block);
+		freeBytes += BLOCK_OVERHEAD;
+		block = prev;
+	}
+	// Merge with the free block above, the sentinel is never free
+	if(next->size & BLOCK_FREE){
+		FreeListRemove(next);
+		block->size += BLOCK_OVERHEAD + BlockSize(next);
+		freeBytes += BLOCK_OVERHEAD;
+	}
+
+	block->size |= BLOCK_FREE;
+	BlockNext(block)->prevPhys = block;
+	FreeListInsert(block);
+}
+
+static void HeapTrim(heap_block_t *block, uint32_t size){
+	// Must be called inside a critical section, on a block in use
+	heap_block_t *rest;
+
+	if(BlockSize(block) < size + BLOCK_OVERHEAD + BLOCK_MIN_SIZE){
+		// The tail is too small to be a block, leave it in this one
+		return;
+	}
+
+	// Split the tail off as a block of its own and free it
+	rest = (heap_block_t *)((uint8_t *)block + BLOCK_OVERHEAD + size);
+	rest->size = BlockSize(block) - size - BLOCK_OVERHEAD;
+	rest->prevPhys = block;
+	BlockNext(rest)->prevPhys = rest;
+	block->size = size;
+	HeapRelease(rest);
+}
+
+static void HeapMapping(uint32_t size, uint32_t *fl, uint32_t *sl){
+	uint32_t msb;
+
+	if(size < HEAP_SMALL_SIZE){
+		// Small blocks, one class per 8 bytes
+		*fl = 0;
+		*sl = size / (HEAP_SMALL_SIZE / HEAP_SL_COUNT);
+	}
+	else{
+		// First level from the most significant bit, second level from the next HEAP_SL_LOG2 bits
+		msb = 31 - __CLZ(size);
+		*sl = (size >> (msb - HEAP_SL_LOG2)) ^ HEAP_SL_COUNT;
+		*fl = msb - (HEAP_FL_SHIFT - 1);
+	}
+}
+
+static void FreeListInsert(heap_block_t *block){
+	// Must be called inside a critical section
+	uint32_t fl, sl;
+
+	// Push on the head of its class, O(1)
+	HeapMapping(BlockSize(block), &fl, &sl);
+	block->prevFree = 0;
+	block->nextFree = freeLists[fl][sl];
+	if(block->nextFree != 0){
+		block->nextFree->prevFree = block;
+	}
+	freeLists[fl][sl] = block;
+	flBitmap |= (1U << fl);
+	slBitmap[fl] |= (1U << sl);
+}
+
+static void FreeListRemove(heap_block_t *block){
+	// Must be called inside a critical section
+	uint32_t fl, sl;
+
+	// Unlink from the doubly linked class list, O(1)
+	HeapMapping(BlockSize(block), &fl, &sl);
+	if(block->prevFree != 0){
+		block->prevFree->nextFree = block->nextFree;
+	}
+	else{
+		freeLists[fl][sl] = block->nextFree;
+	}
+	if(block->nextFree != 0){
+		block->nextFree->prevFree = block->prevFree;
+	}
+
+	// Keep the bitmaps in step with the lists
+	if(freeLists[fl][sl] == 0){
+		slBitmap[fl] &= ~(1U << sl);
+		if(slBitmap[fl] == 0){
+			flBitmap &= ~(1U << fl);
+		}
+	}
+}
+
+#if HEAP_REPLACE_MALLOC
+// The C library's allocator entry points, newlib's own malloc is then never linked in
+// stdio allocates through the reentrant _r variants
+
+struct _reent;
+
+void *malloc(size_t size){
+	void *block = HeapAlloc(size);
+
+	if(block == 0){
+		errno = ENOMEM;
+	}
+	return block;
+}
+
+void free(void *block){
+	HeapFree(block);
+}
+
+void *calloc(size_t count, size_t size){
+	void *block;
+
+	// Refuse a product that does not fit in 32 bits
+	if(size != 0 && count > 0xFFFFFFFFU / size){
+		errno = ENOMEM;
+		return 0;
+	}
+	block = malloc(count * size);
+	if(block != 0){
+		memset(block, 0, count * size);
+	}
+	return block;
+}
+
+void *realloc(void *block, size_t size){
+	void *moved = HeapRealloc(block, size);
+
+	if(moved == 0 && size != 0){
+		errno = ENOMEM;
+	}
+	return moved;
+}
+
+void *_malloc_r(struct _reent *reent, size_t size){
+	return malloc(size);
+}
+
+void _free_r(struct _reent *reent, void *block){
+	free(block);
+}
+
+void *_calloc_r(struct _reent *reent, size_t count, size_t size){
+	return calloc(count, size);
+}
+
+void *_realloc_r(struct _reent *reent, void *block, size_t size){
+	return realloc(block, size);
+}
+#endif
+
+#if HEAP_PROFILE
+// Number of live allocations and of malloc/free calls in the benchmark pattern
+#define BENCH_SLOTS			24
+#define BENCH_ROUNDS		2000
+
+void HeapBenchmark(void){
+	static void *slots[BENCH_SLOTS];
+	uint32_t seed = 1;
+	uint32_t i, slot, start, cycles;
+	uint32_t allocCount = 0, freeCount = 0;
+	uint32_t allocTotal = 0, freeTotal = 0;
+
+	// Enable the trace block and start the DWT cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	// A fixed pseudo-random churn, the same sequence for every heap under test
+	for(i = 0; i < BENCH_ROUNDS; i++){
+		seed = seed * 1664525 + 1013904223;
+		slot = (seed >> 8) % BENCH_SLOTS;
+		if(slots[slot] == 0){
+			start = DWT->CYCCNT;
+			slots[slot] = malloc(8 + ((seed >> 16) & 0x1FF));
+			cycles = DWT->CYCCNT - start;
+			allocTotal += cycles;
+			allocCount++;
+			if(cycles > HeapAllocCyclesMax){
+				HeapAllocCyclesMax = cycles;
+			}
+		}
+		else{
+			start = DWT->CYCCNT;
+			free(slots[slot]);
+			cycles = DWT->CYCCNT - start;
+			slots[slot] = 0;
+			freeTotal += cycles;
+			freeCount++;
+			if(cycles > HeapFreeCyclesMax){
+				HeapFreeCyclesMax = cycles;
+			}
+		}
+	}
+
+	// Leave the heap as it was
+	for(slot = 0; slot < BENCH_SLOTS; slot++){
+		free(slots[slot]);
+		slots[slot] = 0;
+	}
+
+	HeapAllocCyclesAvg = allocCount ? allocTotal / allocCount : 0;
+	HeapFreeCyclesAvg = freeCount ? freeTotal / freeCount : 0;
+}
+#endif
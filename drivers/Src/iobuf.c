@@ -0,0 +1,127 @@
+#include "iobuf.h"
+
+static iobuf_t *IoBufSetup(void *block, mempool_t *pool, uint32_t headroom);
+static void IoBufRelease(iobuf_t *buf, uint8_t *woken, uint8_t fromISR);
+static uint32_t IoBufUnref(iobuf_t *buf);
+
+static inline uint8_t *IoBufStorage(iobuf_t *buf){
+	// Storage starts right after the descriptor, 8-byte aligned like the pool block
+	return (uint8_t *)(buf + 1);
+}
+
+void IoBufPoolInit(mempool_t *pool, void *buffer, uint32_t dataSize, uint32_t count){
+	// Descriptor and storage share one block
+	MemPoolInit(pool, buffer, sizeof(iobuf_t) + dataSize, count);
+}
+
+iobuf_t *IoBufAlloc(mempool_t *pool, uint32_t headroom, uint32_t timeout){
+	void *block = MemPoolAlloc(pool, timeout);
+
+	return block != 0 ? IoBufSetup(block, pool, headroom) : 0;
+}
+
+iobuf_t *IoBufAllocFromISR(mempool_t *pool, uint32_t headroom){
+	void *block = MemPoolAllocFromISR(pool);
+
+	return block != 0 ? IoBufSetup(block, pool, headroom) : 0;
+}
+
+uint8_t *IoBufPrepend(iobuf_t *buf, uint32_t length){
+	// Room left in front of the payload
+	if((uint32_t)(buf->data - IoBufStorage(buf)) < length){
+		return 0;
+	}
+	buf->data -= length;
+	buf->length += length;
+	return buf->data;
+}
+
+uint8_t *IoBufAppend(iobuf_t *buf, uint32_t length){
+	uint8_t *tail = buf->data + buf->length;
+
+	// Room left behind the payload
+	if((uint32_t)(tail - IoBufStorage(buf)) + length > buf->size){
+		return 0;
+	}
+	buf->length += length;
+	return tail;
+}
+
+void IoBufChain(iobuf_t *head, iobuf_t *tail){
+	// Find the last buffer of the packet, chains are a few buffers long
+	while(head->next != 0){
+		head = head->next;
+	}
+	head->next = tail;
+}
+
+uint32_t IoBufChainLength(iobuf_t *buf){
+	uint32_t length = 0;
+
+	for(; buf != 0; buf = buf->next){
+		length += buf->length;
+	}
+	return length;
+}
+
+void IoBufRef(iobuf_t *buf){
+	uint32_t refs;
+
+	// Increment with an exclusive store, owners may drop theirs from an interrupt meanwhile
+	do{
+		refs = __LDREXW(&buf->refs);
+	}while(__STREXW(refs + 1, &buf->refs) != 0);
+}
+
+void IoBufFree(iobuf_t *buf){
+	IoBufRelease(buf, 0, 0);
+}
+
+void IoBufFreeFromISR(iobuf_t *buf, uint8_t *woken){
+	IoBufRelease(buf, woken, 1);
+}
+
+static iobuf_t *IoBufSetup(void *block, mempool_t *pool, uint32_t headroom){
+	iobuf_t *buf = (iobuf_t *)block;
+
+	buf->next = 0;
+	buf->nextPacket = 0;
+	buf->pool = pool;
+	buf->size = pool->blockSize - sizeof(iobuf_t);
+	// Start the payload after the headroom, empty
+	if(headroom > buf->size){
+		headroom = buf->size;
+	}
+	buf->data = IoBufStorage(buf) + headroom;
+	buf->length = 0;
+	// Owned by the caller alone
+	buf->refs = 1;
+	return buf;
+}
+
+static void IoBufRelease(iobuf_t *buf, uint8_t *woken, uint8_t fromISR){
+	iobuf_t *next;
+
+	// Walk down the chain while the buffers lose their last reference
+	while(buf != 0 && IoBufUnref(buf) == 0){
+		// The buffer held the chain's reference on the next one, drop it in turn
+		next = buf->next;
+		if(fromISR){
+			MemPoolFreeFromISR(buf->pool, buf, woken);
+		}
+		else{
+			MemPoolFree(buf->pool, buf);
+		}
+		buf = next;
+	}
+}
+
+static uint32_t IoBufUnref(iobuf_t *buf){
+	uint32_t refs;
+
+	// Decrement with an exclusive store and return the references left
+	do{
+		refs = __LDREXW(&buf->refs);
+	}while(__STREXW(refs - 1, &buf->refs) != 0);
+	return refs - 1;
+}
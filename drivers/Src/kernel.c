@@ -1,45 +1,286 @@
+#include <string.h>
 #include "kernel.h" 
 
 // Define system clock
 #define SYS_CLOCK 			16000000
-// Define the number of threads in the system
-#define NUM_THREADS         3  
-// Define the maximum stack size for each thread
-#define MAX_STACK_SIZE      400
 // Define interrupt control register
 #define INT_CTRL			(*((volatile uint32_t *)0xE000ED04))
+// Define PendSV set-pending bit in the interrupt control register
+#define PENDSVSET			(1U << 28)
+// Define the largest value the 24-bit SysTick counter can be loaded with
+#define SYSTICK_MAX_LOAD	0x00FFFFFF
 
 
+// Define the number of words in the initial stack frame
+// Hardware frame (R0-R3, R12, LR, PC, PSR) + EXC_RETURN + R4-R11
+#define INIT_FRAME_SIZE		17
+
+// Thread states
+#define THREAD_FREE			0	// TCB is unused and available in the pool
+#define THREAD_READY		1	// Thread is in a ready list (running or waiting for the CPU)
+#define THREAD_BLOCKED		2	// Thread is parked in the wait queue of a kernel object
+#define THREAD_DELAYED		3	// Thread is asleep in the delta list (ThreadSleep, next period)
+#define THREAD_DORMANT		4	// TCB is allocated but the thread has not been started yet
+
+// Notification states of a thread
+#define NOTIFY_NONE			0	// No notification since the last ThreadNotifyWait
+#define NOTIFY_PENDING		1	// Notified, the next ThreadNotifyWait returns at once
+#define NOTIFY_WAITING		2	// Blocked in ThreadNotifyWait
+
+// Define the idle thread's stack size in bytes
+#define IDLE_STACK_SIZE		128
+
+// Define the periodic job dispatcher's stack size in bytes
+#ifndef PERIODIC_STACK_SIZE
+#define PERIODIC_STACK_SIZE	512
+#endif
+
+// Bit 0 of a mutex lock word, set while threads are blocked on the mutex
+// TCBs are word aligned, so the rest of the word is the owner's address
+#define MUTEX_CONTENDED		1U
+
+// Define the number of Liu-Layland bounds kept in the table
+#define RMS_BOUND_TABLE_SIZE	32
+// Define the Liu-Layland bound for larger task sets, ln(2) in parts per million
+#define RMS_BOUND_LIMIT			693147
+
 // Thread Control Block (TCB) structure definition
-typedef struct tcb_t{
+struct tcb_t{
     int32_t *stackPtr;        // Pointer to the top of the stack for this thread
-    struct tcb_t *nextStackPtr;      // Pointer to the next TCB in the linked list (for round-robin scheduling)
-} tcb_t;
+    struct tcb_t *nextPtr;    // Pointer to the next TCB in the ready list of the same priority, or in the wait queue
+    struct tcb_t *prevPtr;    // Pointer to the previous TCB in the ready list of the same priority, or in the wait queue
+    uint32_t priority;        // Scheduling priority (0 is the highest), raised while a mutex it holds is wanted
+    uint32_t basePriority;    // Priority assigned to the thread, without inheritance
+    uint32_t state;           // THREAD_FREE, THREAD_READY, THREAD_BLOCKED
+    waitqueue_t *waitQueue;   // Wait queue the thread is blocked on
+    struct tcb_t *delayNextPtr; // Pointer to the next TCB in the delta list
+    uint32_t delayTicks;      // Ticks to sleep after the previous TCB in the delta list wakes up
+    uint32_t period;          // Release period in ticks, 0 for aperiodic threads
+    uint32_t relDeadline;     // Deadline relative to the release, in ticks
+    uint32_t release;         // Absolute release time of the current job
+    uint32_t absDeadline;     // Absolute deadline of the current job, the EDF key
+    uint32_t heapIndex;       // Position in the EDF heap while ready
+    uint32_t deadlineMisses;  // Number of jobs that completed after their deadline
+    uint32_t wcet;            // Worst-case execution time per job in ticks, rate-monotonic threads only
+    uint8_t wakePending;      // Set by ThreadWake while awake, cuts the next sleep short
+    mutex_t *heldMutexes;     // Mutexes owned by the thread that other threads are blocked on
+    mutex_t *blockedMutex;    // Mutex the thread is blocked on, followed for transitive inheritance
+    mutex_t *ownedMutexes;    // Every mutex owned by the thread, released when it exits
+    uint32_t notifyValue;     // Notification word, updated by ThreadNotify
+    uint8_t notifyState;      // NOTIFY_NONE, NOTIFY_PENDING, NOTIFY_WAITING
+    uint32_t eventBits;       // Flags waited for in EventGroupWait
+    uint32_t eventResult;     // Flags of the group when the wait was satisfied
+    uint8_t eventOptions;     // EVENT_WAIT_ALL and EVENT_CLEAR of the pending wait
+    void *waitBuffer;         // Message being sent, or where to put the one received, while blocked on a queue
+    uint8_t timedWait;        // Blocked with a timeout, also sits in the delta list
+    uint8_t waitTimedOut;     // The last timed wait ended because the timeout ran out
+};
 
-// Array of TCBs, one for each thread
-tcb_t tcb[NUM_THREADS]; 
+// Pool of TCBs, a slot is taken by ThreadCreate and released when the thread returns
+tcb_t tcb[MAX_THREADS];
 
 // Pointer to the currently executing thread's TCB
 tcb_t *currStackPtr;
 
-// Array representing the stacks for each thread
-// Each thread is assigned its own stack space
-int32_t TCB_STACK[NUM_THREADS][MAX_STACK_SIZE];
+// Set once the first thread has been started
+static uint8_t kernelRunning = 0;
+
+// Idle thread, runs at LOWEST_PRIORITY whenever every other thread is blocked
+THREAD_STACK(idleStack, IDLE_STACK_SIZE);
+
+// Number of idle loop iterations, a measure of the CPU time left over by the threads
+volatile uint32_t IdleCount = 0;
 
 // Prescaler value for millisecond timing
 uint32_t MS_PRESCALER = 0;
 
-// Period tick value
-uint32_t PERIOD_TICK = 0;
 
-static void KernelStackInit(uint8_t i);
+// Number of ticks since the kernel was launched
+volatile uint32_t KernelTicks = 0;
+
+// Number of SysTick clock cycles in one tick (one quanta)
+static uint32_t tickReload = 0;
+
+#if KERNEL_PROFILE_SWITCH
+// DWT cycle count at PendSV entry
+uint32_t switchStart = 0;
+// Cycles spent in the last and in the slowest context switch
+volatile uint32_t SwitchCycles = 0, SwitchCyclesMax = 0;
+// Cycles spent in the last tick handler
+volatile uint32_t TickCycles = 0;
+// Cycles spent in an uncontended SemaphoreGive/SemaphoreWait pair, measured at KernelInit
+volatile uint32_t SemaphoreCycles = 0;
+#endif
+
+// BASEPRI value of a kernel critical section, for the assembly of PendSV_Handler
+const uint32_t kernelBasepri = KERNEL_BASEPRI;
+
+// Ready bitmap, bit (31 - p) is set while priority level p has at least one ready thread
+// Keeping priority 0 in the MSB lets __CLZ return the highest ready priority directly
+static uint32_t readyBitmap = 0;
+
+// Circular ready list of each priority level, the head is the next thread to run at that level
+// The EDF_PRIORITY level is the exception, its head is the top of the EDF heap
+static tcb_t *readyList[NUM_PRIORITIES];
+
+// Binary min-heap of the ready threads at EDF_PRIORITY, keyed by absolute deadline
+static tcb_t *edfHeap[MAX_THREADS];
+static uint32_t edfCount = 0;
+
+// Delta list of sleeping threads, sorted by wakeup time
+// Each entry stores its delay relative to the entry before it, so the tick only touches the head
+static tcb_t *delayList = 0;
+
+// Periodic job table entry
+typedef struct{
+    void (*job)(void);        // Callback, 0 for a free entry
+    uint32_t period;          // Period in ticks
+    uint32_t phase;           // Offset in ticks from periodicAnchor, the job runs at anchor + phase + k * period
+    uint32_t nextDue;         // Absolute tick of the next run
+} periodic_job_t;
+
+// Table of periodic jobs run by the dispatcher thread
+static periodic_job_t periodicJobs[MAX_PERIODIC_JOBS];
+
+// Earliest nextDue of all jobs, checked by the tick
+static volatile uint32_t periodicNextDue = 0;
+// Set while the dispatcher has been signalled but has not computed the next due tick yet
+static volatile uint8_t periodicPending = 0;
+// Number of jobs in the table
+static uint32_t periodicCount = 0;
+// Tick the job phases count from, only ever moved by whole hyperperiods
+static uint32_t periodicAnchor = 0;
+// Least common multiple of the job periods, 0 once it no longer fits in 32 bits
+static uint32_t periodicHyperperiod = 1;
+// Wakes the dispatcher thread when a job is due
+static semaphore_t periodicSignal;
+// Dispatcher thread stack
+THREAD_STACK(periodicStack, PERIODIC_STACK_SIZE);
+
+// Rate-monotonic threads sorted by period, the index gives the priority order
+static tcb_t *rmsTable[MAX_THREADS];
+static uint32_t rmsCount = 0;
+
+// Snapshot of the rate-monotonic task set (plus the candidate) for the admission test
+static uint32_t rmsPeriod[MAX_THREADS + 1], rmsWcet[MAX_THREADS + 1];
+
+// Serializes admission tests, the test itself runs with interrupts enabled
+// Free from the start, ThreadCreatePeriodic may run before KernelInit
+static semaphore_t rmsLock = { .count = 1 };
+
+// Liu-Layland utilization bound n(2^(1/n) - 1) in parts per million, for n = 1..32
+static const uint32_t rmsBound[RMS_BOUND_TABLE_SIZE] = {
+	1000000, 828427, 779763, 756828, 743491, 734772, 728626, 724061,
+	720537, 717734, 715451, 713557, 711958, 710592, 709411, 708380,
+	707472, 706666, 705945, 705298, 704713, 704182, 703697, 703253,
+	702845, 702469, 702121, 701797, 701497, 701216, 700954, 700708
+};
+
+static void KernelStackInit(tcb_t *thread, void (*task)(void *), void *arg, uint32_t *stack, uint32_t stackSize);
 static void SchedulerLaunch(void);
+static void ReadyInsert(tcb_t *thread);
+static void ReadyRemove(tcb_t *thread);
+static void KernelPreempt(void);
+static uint8_t KernelPreemptNeeded(void);
+static void ThreadExit(void);
+static void IdleThread(void *arg);
+static tcb_t *ThreadAlloc(void (*task)(void *), void *arg, uint32_t *stack, uint32_t stackSize);
+static void ThreadStart(tcb_t *thread);
+static void ReadyRotate(void);
+static uint8_t EdfEarlier(tcb_t *a, tcb_t *b);
+static void EdfSwap(uint32_t i, uint32_t j);
+static void EdfSiftUp(uint32_t i);
+static void EdfSiftDown(uint32_t i);
+static void EdfInsert(tcb_t *thread);
+static void EdfRemove(tcb_t *thread);
+static void DelayInsert(tcb_t *thread, uint32_t ticks);
+static void DelayRemove(tcb_t *thread);
+static void ThreadChangePriority(tcb_t *thread, uint32_t priority);
+static void ThreadChangeBasePriority(tcb_t *thread, uint32_t priority);
+static uint32_t ThreadEffectivePriority(tcb_t *thread);
+static void ThreadUpdatePriority(tcb_t *thread);
+static uint8_t NotifyApply(tcb_t *thread, uint32_t value, uint8_t action);
+static uint8_t EventSatisfied(uint32_t flags, uint32_t bits, uint8_t options);
+static uint8_t EventGroupRelease(eventgroup_t *group);
+static void MutexTake(mutex_t *mutex);
+static void MutexLockSlow(mutex_t *mutex);
+static void MutexUnlockSlow(mutex_t *mutex);
+static void MutexOwnedAdd(tcb_t *thread, mutex_t *mutex);
+static void MutexOwnedRemove(tcb_t *thread, mutex_t *mutex);
+static uint8_t RmsAdmit(uint32_t n);
+static uint8_t RmsAssignPriorities(void);
+static void RmsRemove(tcb_t *thread);
+static void PeriodicThread(void *arg);
+static void PeriodicUpdateNextDue(void);
+static uint32_t PeriodicAutoPhase(uint32_t period);
+static uint32_t Gcd(uint32_t a, uint32_t b);
+#if KERNEL_TICKLESS
+static uint32_t KernelNextWakeup(void);
+static void KernelIdleSleep(void);
+#endif
+static void WaitQueueInsert(waitqueue_t *queue, tcb_t *thread);
+static void WaitQueueRemove(tcb_t *thread);
+static void KernelBlock(waitqueue_t *queue);
+static void KernelBlockTimeout(waitqueue_t *queue, uint32_t timeout);
+static tcb_t *KernelWake(waitqueue_t *queue);
+static void KernelWakeThread(tcb_t *thread);
+static uint8_t MsgQueuePut(msgqueue_t *queue, const void *item, uint8_t *woken);
+static uint8_t MsgQueueGet(msgqueue_t *queue, void *item, uint8_t *woken);
+static void SemaphoreGiveSlow(semaphore_t *semaphore);
+static uint8_t MpmcQueuePush(mpmcqueue_t *queue, const void *item);
+static uint8_t MpmcQueuePop(mpmcqueue_t *queue, void *item);
+static uint8_t MpmcQueueClaim(volatile uint32_t *index, uint32_t pos);
+static uint8_t MpmcQueueWait(mpmcqueue_t *queue, void *item, uint32_t timeout, uint8_t receive);
+static uint8_t MpmcQueueRelease(waitqueue_t *queue, volatile uint32_t *waiting);
+static void *MemPoolTake(mempool_t *pool);
+static uint8_t MemPoolGive(mempool_t *pool, void *block);
+static void SemaphoreWaitSlow(semaphore_t *semaphore);
 
 void KernelInit(void){
 	MS_PRESCALER = SYS_CLOCK / 1000;
+
+	// Enable full access to the FPU (CP10 and CP11)
+	SCB->CPACR |= (0xFU << 20);
+	__DSB();
+	__ISB();
+
+	// Keep automatic and lazy FPU state preservation on
+	// Threads that touch the FPU get an extended exception frame with S0-S15 space
+	// reserved, the registers are only stacked if the handler itself uses the FPU
+	FPU->FPCCR |= FPU_FPCCR_ASPEN_Msk | FPU_FPCCR_LSPEN_Msk;
+
+	// Create the periodic job dispatcher above every other thread
+	SemaphoreInit(&periodicSignal, 0);
+	ThreadCreate(&PeriodicThread, 0, PERIODIC_PRIORITY, periodicStack, sizeof(periodicStack));
+
+	// Create the idle thread so that there is always a thread to switch to
+	ThreadCreate(&IdleThread, 0, LOWEST_PRIORITY, idleStack, sizeof(idleStack));
+
+#if KERNEL_PROFILE_SWITCH
+	// Enable the trace block and start the DWT cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	// Time an uncontended give/take pair, both stay on the exclusive-access fast path
+	{
+		semaphore_t probe;
+		uint32_t start;
+
+		SemaphoreInit(&probe, 0);
+		start = DWT->CYCCNT;
+		SemaphoreGive(&probe);
+		SemaphoreWait(&probe);
+		SemaphoreCycles = DWT->CYCCNT - start;
+	}
+#endif
 }
 
 void KernelLaunch(uint32_t quanta){
+	// Disable global interrupts
+	// No tick may pend a switch before the first thread is on PSP, SchedulerLaunch re-enables them
+	__disable_irq();
+
 	// Reset SysTick timer
 	SysTick->CTRL = 0;
 
@@ -47,11 +288,16 @@ void KernelLaunch(uint32_t quanta){
     SysTick->VAL = 0;
 
     // Configure SysTick Reload Value Register to equal the quanta value
-    SysTick->LOAD = (quanta * MS_PRESCALER) - 1;
+    tickReload = quanta * MS_PRESCALER;
+    SysTick->LOAD = tickReload - 1;
+
+    // Set PendSV to lowest priority
+    // The context switch tail-chains after every hardware interrupt instead of delaying them
+    NVIC_SetPriority(PendSV_IRQn, 15);
 
-    // Set SysTick to lowest priority
-    // Necessary to prioritize hardware interrupts
-    NVIC_SetPriority(SysTick_IRQn, 15);
+    // Set SysTick just above PendSV
+    // Necessary to prioritize hardware interrupts, the tick only does time accounting
+    NVIC_SetPriority(SysTick_IRQn, 14);
 
     // Select the processor clock as the SysTick clock source
     SysTick->CTRL |= (1U << 2);
@@ -62,213 +308,2407 @@ void KernelLaunch(uint32_t quanta){
     // Enable SysTick interrupt request
     SysTick->CTRL |= (1U << 1);
 
+    // Start from the highest priority ready thread
+    // Priorities may have changed since the threads were created
+    currStackPtr = readyList[__CLZ(readyBitmap)];
+    kernelRunning = 1;
+
     // Launch the Scheduler
     SchedulerLaunch();
 
 }
 
-uint8_t KernelCreateThreads(void(*task0)(void), void(*task1)(void), void(*task2)(void)){
-	// Disable global interrupts
-	__disable_irq();
+tcb_t *ThreadCreate(void (*task)(void *arg), void *arg, uint8_t priority, uint32_t *stack, uint32_t stackSize){
+	uint32_t mask;
+	tcb_t *thread;
+
+	// Reject priorities that do not exist, EDF_PRIORITY belongs to ThreadCreateEDF
+	if(priority >= NUM_PRIORITIES || priority == EDF_PRIORITY){
+		return 0;
+	}
 
-	// Initialize TCB *nextStackPtr for each thread
-	tcb[0].nextStackPtr = &tcb[1];
-	tcb[1].nextStackPtr = &tcb[2];
-	tcb[2].nextStackPtr = &tcb[0];
+	// Enter a critical section
+	mask = KernelEnterCritical();
 
-	// Initialize stack for thread 0
-	KernelStackInit(0);
-	// Initialize PC for thread 0
-	TCB_STACK[0][MAX_STACK_SIZE-2] = (int32_t)(task0);
+	thread = ThreadAlloc(task, arg, stack, stackSize);
+	if(thread != 0){
+		// Make the thread ready at its priority
+		thread->priority = priority;
+		ThreadStart(thread);
+	}
 
-	// Initialize stack for thread 1
-	KernelStackInit(1);
-	// Initialize PC for thread 1
-	TCB_STACK[1][MAX_STACK_SIZE-2] = (int32_t)(task1);
+	// Leave the critical section
+	KernelExitCritical(mask);
 
-	// Initialize stack for thread 2
-	KernelStackInit(2);
-	// Initialize PC for thread 0
-	TCB_STACK[2][MAX_STACK_SIZE-2] = (int32_t)(task2);
+	return thread;
+}
 
-	// Start from thread 0
-	currStackPtr = &tcb[0];
+tcb_t *ThreadCreateEDF(void (*task)(void *arg), void *arg, uint32_t *stack, uint32_t stackSize, uint32_t period, uint32_t deadline){
+	uint32_t mask;
+	tcb_t *thread;
 
-	// Enable global interrupts
-	__enable_irq();
+	// An implicit deadline equals the period
+	if(deadline == 0){
+		deadline = period;
+	}
+	// Only constrained deadlines (deadline <= period) are supported
+	if(period == 0 || deadline > period){
+		return 0;
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	thread = ThreadAlloc(task, arg, stack, stackSize);
+	if(thread != 0){
+		// First job is released now
+		thread->priority = EDF_PRIORITY;
+		thread->period = period;
+		thread->relDeadline = deadline;
+		thread->release = KernelTicks;
+		thread->absDeadline = KernelTicks + deadline;
+		ThreadStart(thread);
+	}
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return thread;
+}
+
+tcb_t *ThreadCreatePeriodic(void (*task)(void *arg), void *arg, uint32_t *stack, uint32_t stackSize, uint32_t period, uint32_t wcet){
+	uint32_t mask;
+	tcb_t *thread = 0;
+	uint32_t n, i;
+
+	// A job has to fit in its period
+	if(period == 0 || wcet == 0 || wcet > period){
+		return 0;
+	}
+
+	// Only one admission test at a time
+	SemaphoreWait(&rmsLock);
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	// Snapshot the admitted task set and insert the candidate in period order
+	n = 0;
+	for(i = 0; i < rmsCount; i++){
+		if(n == i && rmsTable[i]->period > period){
+			rmsPeriod[n] = period;
+			rmsWcet[n++] = wcet;
+		}
+		rmsPeriod[n] = rmsTable[i]->period;
+		rmsWcet[n++] = rmsTable[i]->wcet;
+	}
+	if(n == rmsCount){
+		rmsPeriod[n] = period;
+		rmsWcet[n++] = wcet;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	// Run the schedulability test with interrupts enabled
+	if(RmsAdmit(n)){
+		// Enter a critical section
+		mask = KernelEnterCritical();
+
+		thread = ThreadAlloc(task, arg, stack, stackSize);
+		if(thread != 0){
+			// First job is released now
+			thread->period = period;
+			thread->relDeadline = period;
+			thread->wcet = wcet;
+			thread->release = KernelTicks;
+			thread->absDeadline = KernelTicks + period;
+
+			// Insert in period order, equal periods in creation order
+			for(i = rmsCount; i > 0 && rmsTable[i - 1]->period > period; i--){
+				rmsTable[i] = rmsTable[i - 1];
+			}
+			rmsTable[i] = thread;
+			rmsCount++;
+
+			// Shorter periods get higher priorities, give up if the band is too narrow
+			if(RmsAssignPriorities()){
+				ThreadStart(thread);
+			}
+			else{
+				RmsRemove(thread);
+				RmsAssignPriorities();
+				thread->state = THREAD_FREE;
+				thread = 0;
+			}
+		}
 
+		// Leave the critical section
+		KernelExitCritical(mask);
+	}
+
+	SemaphoreGive(&rmsLock);
+
+	return thread;
+}
+
+static uint8_t RmsAdmit(uint32_t n){
+	uint64_t utilization = 0;
+	uint32_t bound, i, j;
+
+	// Total utilization in parts per million, rounded up to stay on the safe side
+	for(i = 0; i < n; i++){
+		utilization += ((uint64_t)rmsWcet[i] * 1000000 + rmsPeriod[i] - 1) / rmsPeriod[i];
+	}
+	// Nothing can be scheduled beyond 100%
+	if(utilization > 1000000){
+		return 0;
+	}
+
+	// Liu-Layland: below n(2^(1/n) - 1) the set is schedulable
+	bound = (n <= RMS_BOUND_TABLE_SIZE) ? rmsBound[n - 1] : RMS_BOUND_LIMIT;
+	if(utilization <= bound){
+		return 1;
+	}
+
+	// Exact response-time analysis, the task set is sorted by period
+	// R = C_i + sum over higher or equal priority tasks j of ceil(R / T_j) * C_j
+	// Equal periods share a priority level and are counted as interference both ways
+	for(i = 0; i < n; i++){
+		uint32_t response = rmsWcet[i];
+		uint32_t next;
+
+		while(1){
+			next = rmsWcet[i];
+			for(j = 0; j < n; j++){
+				if(j != i && rmsPeriod[j] <= rmsPeriod[i]){
+					next += ((response + rmsPeriod[j] - 1) / rmsPeriod[j]) * rmsWcet[j];
+				}
+			}
+			// Misses its deadline (the end of its period)
+			if(next > rmsPeriod[i]){
+				return 0;
+			}
+			// Fixed point reached, this is the worst-case response time
+			if(next == response){
+				break;
+			}
+			response = next;
+		}
+	}
+	return 1;
+}
+
+static uint8_t RmsAssignPriorities(void){
+	// Must be called inside a critical section
+	uint32_t priority = RMS_PRIORITY_HIGHEST;
+
+	for(uint32_t i = 0; i < rmsCount; i++){
+		// A longer period than the previous thread gets the next lower priority
+		if(i > 0 && rmsTable[i]->period != rmsTable[i - 1]->period){
+			priority++;
+		}
+		if(priority > RMS_PRIORITY_LOWEST){
+			return 0;
+		}
+		ThreadChangeBasePriority(rmsTable[i], priority);
+	}
 	return 1;
 }
 
-static void KernelStackInit(uint8_t i){
+static void RmsRemove(tcb_t *thread){
+	// Must be called inside a critical section
+	for(uint32_t i = 0; i < rmsCount; i++){
+		if(rmsTable[i] == thread){
+			// Close the gap, the remaining threads keep their period order
+			for(; i + 1 < rmsCount; i++){
+				rmsTable[i] = rmsTable[i + 1];
+			}
+			rmsCount--;
+			return;
+		}
+	}
+}
+
+static tcb_t *ThreadAlloc(void (*task)(void *), void *arg, uint32_t *stack, uint32_t stackSize){
+	// Must be called inside a critical section
+	// Reject stacks too small for the initial frame
+	if(stack == 0 || stackSize < THREAD_MIN_STACK_SIZE){
+		return 0;
+	}
+
+	// Take the first free TCB from the pool
+	for(uint32_t i = 0; i < MAX_THREADS; i++){
+		if(tcb[i].state == THREAD_FREE){
+			// Build the initial frame on the caller's stack
+			KernelStackInit(&tcb[i], task, arg, stack, stackSize);
+			// Aperiodic until told otherwise, an absolute deadline of 0 sorts first in the EDF heap
+			tcb[i].period = 0;
+			tcb[i].relDeadline = 0;
+			tcb[i].release = 0;
+			tcb[i].absDeadline = 0;
+			tcb[i].deadlineMisses = 0;
+			tcb[i].wcet = 0;
+			tcb[i].wakePending = 0;
+			tcb[i].heldMutexes = 0;
+			tcb[i].blockedMutex = 0;
+			tcb[i].ownedMutexes = 0;
+			tcb[i].notifyValue = 0;
+			tcb[i].notifyState = NOTIFY_NONE;
+			tcb[i].timedWait = 0;
+			// Not in any list yet
+			tcb[i].state = THREAD_DORMANT;
+			tcb[i].priority = LOWEST_PRIORITY;
+			return &tcb[i];
+		}
+	}
+	return 0;
+}
+
+static void ThreadStart(tcb_t *thread){
+	// Must be called inside a critical section
+	// The priority the thread was created with is the one it falls back to after inheritance
+	thread->basePriority = thread->priority;
+	thread->state = THREAD_READY;
+	ReadyInsert(thread);
+	// Run it right away if it outranks the caller
+	KernelPreempt();
+}
+
+static void KernelStackInit(tcb_t *thread, void (*task)(void *), void *arg, uint32_t *stack, uint32_t stackSize){
+	// Top of the stack, rounded down to the 8-byte alignment required by the AAPCS and exception entry
+	int32_t *stackTop = (int32_t *)(((uint32_t)stack + stackSize) & ~7U);
+
 	// Initialize Stack Pointer (R13)
-	tcb[i].stackPtr = &TCB_STACK[i][MAX_STACK_SIZE-16];
+	thread->stackPtr = stackTop - INIT_FRAME_SIZE;
 	// Set thumb bit 24 in the EPSR to 1
 	// The Cortex-M4 processor only supports execution of instructions in Thumb state
-	TCB_STACK[i][MAX_STACK_SIZE-1] = (1U <<  24);
+	stackTop[-1] = (1U <<  24);
+	// Initialize PC with the thread's entry point
+	stackTop[-2] = (int32_t)(task);
+	// Link Register (R14)
+	// A thread that returns from its entry point ends up in ThreadExit
+	stackTop[-3] = (int32_t)(ThreadExit);
 
 	// Initialize the stack content to 0xAAAAAAAA
-	// Link Register (R14)
-	TCB_STACK[i][MAX_STACK_SIZE-3] = 0xAAAAAAAA;
 	// R12
-	TCB_STACK[i][MAX_STACK_SIZE-4] = 0xAAAAAAAA;
+	stackTop[-4] = 0xAAAAAAAA;
 	// R3
-	TCB_STACK[i][MAX_STACK_SIZE-5] = 0xAAAAAAAA;
+	stackTop[-5] = 0xAAAAAAAA;
 	// R2
-	TCB_STACK[i][MAX_STACK_SIZE-6] = 0xAAAAAAAA;
+	stackTop[-6] = 0xAAAAAAAA;
 	// R1
-	TCB_STACK[i][MAX_STACK_SIZE-7] = 0xAAAAAAAA;
-	// R0
-	TCB_STACK[i][MAX_STACK_SIZE-8] = 0xAAAAAAAA;
+	stackTop[-7] = 0xAAAAAAAA;
+	// R0 carries the thread's argument
+	stackTop[-8] = (int32_t)(arg);
+
+	// EXC_RETURN used when PendSV resumes the thread
+	// 0xFFFFFFFD (CMSIS EXC_RETURN_THREAD_PSP): thread mode, PSP, no FPU context (bit 4 set)
+	stackTop[-9] = (int32_t)EXC_RETURN_THREAD_PSP;
 
 	// Initialize additional general-purpose registers
 	// R11
-	TCB_STACK[i][MAX_STACK_SIZE-9] = 0xAAAAAAAA;
+	stackTop[-10] = 0xAAAAAAAA;
 	// R10
-	TCB_STACK[i][MAX_STACK_SIZE-10] = 0xAAAAAAAA;
+	stackTop[-11] = 0xAAAAAAAA;
 	// R9
-	TCB_STACK[i][MAX_STACK_SIZE-11] = 0xAAAAAAAA;
+	stackTop[-12] = 0xAAAAAAAA;
 	// R8
-	TCB_STACK[i][MAX_STACK_SIZE-12] = 0xAAAAAAAA;
+	stackTop[-13] = 0xAAAAAAAA;
 	// R7
-	TCB_STACK[i][MAX_STACK_SIZE-13] = 0xAAAAAAAA;
+	stackTop[-14] = 0xAAAAAAAA;
 	// R6
-	TCB_STACK[i][MAX_STACK_SIZE-14] = 0xAAAAAAAA;
+	stackTop[-15] = 0xAAAAAAAA;
 	// R5
-	TCB_STACK[i][MAX_STACK_SIZE-15] = 0xAAAAAAAA;
+	stackTop[-16] = 0xAAAAAAAA;
 	// R4
-	TCB_STACK[i][MAX_STACK_SIZE-16] = 0xAAAAAAAA;
+	stackTop[-17] = 0xAAAAAAAA;
 }
 
-__attribute__((naked)) void SysTick_Handler(void) {
-	// Disable global interrupts
-	__asm("CPSID	I");
+static void ThreadExit(void){
+	uint32_t mask;
+	mutex_t *mutex;
+
+	// Release every mutex still owned, waiters would otherwise block forever on a freed TCB
+	// Unlocking also hands each contended one over and drops any ceiling or inherited priority
+	while((mutex = currStackPtr->ownedMutexes) != 0){
+		mutex->count = 1;
+		MutexUnlock(mutex);
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	// Leave the ready set and hand the TCB back to the pool
+	// The stale context PendSV saves into it is overwritten by the next ThreadCreate
+	ReadyRemove(currStackPtr);
+	currStackPtr->state = THREAD_FREE;
+	// A rate-monotonic thread no longer counts against the admission test
+	if(currStackPtr->wcet != 0){
+		RmsRemove(currStackPtr);
+	}
+	// Switch away for good
+	INT_CTRL = PENDSVSET;
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	while(1){}
+}
+
+void SysTick_Handler(void){
+	uint32_t mask;
+#if KERNEL_PROFILE_SWITCH
+	// Timestamp the start of the tick
+	uint32_t start = DWT->CYCCNT;
+#endif
+
+	// Enter a critical section, interrupts above SysTick may call the kernel too
+	mask = KernelEnterCritical();
+
+	// Count the tick
+	KernelTicks++;
+
+	// Wake the dispatcher thread when a periodic job is due, the jobs run in thread context
+	if(periodicCount != 0 && !periodicPending && (int32_t)(KernelTicks - periodicNextDue) >= 0){
+		periodicPending = 1;
+		SemaphoreGive(&periodicSignal);
+	}
+
+	// Count down the first sleeper, the others are relative to it
+	if(delayList != 0){
+		delayList->delayTicks--;
+		// Wake every thread whose delay has run out
+		while(delayList != 0 && delayList->delayTicks == 0){
+			tcb_t *thread = delayList;
+			delayList = thread->delayNextPtr;
+			if(thread->state == THREAD_BLOCKED){
+				// A timed wait ran out, give up on the kernel object
+				WaitQueueRemove(thread);
+				thread->timedWait = 0;
+				thread->waitTimedOut = 1;
+			}
+			thread->state = THREAD_READY;
+			ReadyInsert(thread);
+		}
+	}
+
+	// The current thread used up its quanta, move it behind its equal priority peers
+	ReadyRotate();
+
+	// Only pay for a context switch when another thread has to run
+	KernelPreempt();
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+#if KERNEL_PROFILE_SWITCH
+	// Record the cost of the tick itself
+	TickCycles = DWT->CYCCNT - start;
+#endif
+}
+
+__attribute__((naked)) void PendSV_Handler(void) {
+#if KERNEL_PROFILE_SWITCH
+	// Timestamp the start of the switch (R2, R3 are restored by hardware on exit)
+	__asm("LDR R2,=0xE0001004");
+	__asm("LDR R3,[R2]");
+	__asm("LDR R2,=switchStart");
+	__asm("STR R3,[R2]");
+#endif
 
 	// Suspend the current thread
+	// The hardware already stacked R0-R3, R12, LR, PC and PSR on the thread's PSP
+	// Load R0 with the thread's stack pointer (PSP)
+	__asm("MRS R0,PSP");
+	// EXC_RETURN bit 4 is clear when the thread has an FPU context (extended frame)
+	// Only then save the high FP registers S16-S31, S0-S15 are lazily stacked by hardware
+	__asm("TST LR,#0x10");
+	__asm("IT EQ");
+	__asm("VSTMDBEQ R0!,{S16-S31}");
 	// Save remaining general-purpose registers (R4, R5, R6, R7, R9, R10, R11)
-	__asm("PUSH {R4-R11}");
-	// Load address of currStackPtr into R0
-	__asm("LDR R0,=currStackPtr");
-	// Load R1 with value at address R0 (R1= currStackPtr)
-	__asm("LDR R1,[R0]");
-	// Store ARM Cortex-M SP from address R1
-	__asm("STR SP,[R1]");
+	// and the thread's EXC_RETURN below the hardware frame
+	__asm("STMDB R0!,{R4-R11,LR}");
+	// Load address of currStackPtr into R1
+	__asm("LDR R1,=currStackPtr");
+	// Load R2 with value at address R1 (R2= currStackPtr)
+	__asm("LDR R2,[R1]");
+	// Store the thread's stack pointer in its TCB
+	__asm("STR R0,[R2]");
 
 	// Choose the next thread
-	// Push R0 and LR to the stack
-	__asm("PUSH {R0,LR}");
-	// Save current instruction address + 4 and jump to SchedulerRoundRobin
-	__asm("BL SchedulerRoundRobin");
-	// Pop R0 and LR from the stack
-	__asm("POP {R0,LR}");
-	// Load R1 with value at address R0
-	__asm("LDR R1,[R0]");
-	// Load ARM Cortex-M SP with value address R1
-	__asm("LDR SP,[R1]");
-	// Restore R4-R11
-	__asm("POP {R4-R11}");
+	// Only the ready list lookup has to be atomic, the register save above can be interrupted
+	// Mask the interrupts that use the kernel, the ones above KERNEL_MAX_SYSCALL_PRIORITY keep running
+	__asm("LDR R2,=kernelBasepri");
+	__asm("LDR R2,[R2]");
+	__asm("MSR BASEPRI,R2");
+	__asm("ISB");
+	// Push R1 and LR to the interrupt stack (MSP)
+	__asm("PUSH {R1,LR}");
+	// Save current instruction address + 4 and jump to SchedulerPriority
+	__asm("BL SchedulerPriority");
+	// Pop R1 and LR from the interrupt stack
+	__asm("POP {R1,LR}");
+	// Unmask again, PendSV is the lowest priority so nothing was masked on entry
+	__asm("MOV R2,#0");
+	__asm("MSR BASEPRI,R2");
 
-	// Enable global interrupts
-	__asm("CPSIE	I");
+	// Resume the next thread
+	// Load R2 with value at address R1 (R2= currStackPtr)
+	__asm("LDR R2,[R1]");
+	// Load R0 with the next thread's stack pointer
+	__asm("LDR R0,[R2]");
+	// Restore R4-R11 and the thread's EXC_RETURN
+	__asm("LDMIA R0!,{R4-R11,LR}");
+	// Restore S16-S31 if the thread was suspended with an FPU context
+	__asm("TST LR,#0x10");
+	__asm("IT EQ");
+	__asm("VLDMIAEQ R0!,{S16-S31}");
+	// Point PSP at the hardware frame, it is unstacked by the exception return
+	__asm("MSR PSP,R0");
+
+#if KERNEL_PROFILE_SWITCH
+	// Record the cycles spent in the switch and keep the worst case
+	__asm("LDR R2,=0xE0001004");
+	__asm("LDR R3,[R2]");
+	__asm("LDR R2,=switchStart");
+	__asm("LDR R2,[R2]");
+	__asm("SUB R3,R3,R2");
+	__asm("LDR R2,=SwitchCycles");
+	__asm("STR R3,[R2]");
+	__asm("LDR R2,=SwitchCyclesMax");
+	__asm("LDR R0,[R2]");
+	__asm("CMP R3,R0");
+	__asm("IT HI");
+	__asm("STRHI R3,[R2]");
+#endif
 
 	// Return from exception
-	// Restore R0, R1, R2, R3, R12, LR, PC, PSR
+	// LR holds EXC_RETURN 0xFFFFFFFD (thread mode, PSP) or 0xFFFFFFED (same, extended FPU frame)
+	// Restore R0, R1, R2, R3, R12, LR, PC, PSR from the PSP
 	__asm("BX	LR");
 }
 
-static void SchedulerLaunch(void){
+__attribute__((naked)) static void SchedulerLaunch(void){
+	// Reset MSP to the top of RAM, from here on it is the dedicated interrupt stack
+	// The linker scripts reserve _Min_Stack_Size bytes below _estack for it
+	__asm("LDR R0,=_estack");
+	__asm("MSR MSP,R0");
 	// Load currentPtr address into R0
 	__asm("LDR R0,=currStackPtr");
 	// Load R2 from address R0 (Set R2=currStackPtr)
 	__asm("LDR R2,[R0]");
-	// Load ARM Cortex-M SP from address R2
-	__asm("LDR SP,[R2]");
+	// Load R1 with the thread's stack pointer
+	__asm("LDR R1,[R2]");
+	// Load PSP with the thread's stack pointer
+	__asm("MSR PSP,R1");
+	// Set CONTROL.SPSEL so thread mode runs on PSP
+	__asm("MOV R0,#2");
+	__asm("MSR CONTROL,R0");
+	// Make sure the following instructions use the new stack pointer
+	__asm("ISB");
 	// Restore R4-R11
 	__asm("POP {R4-R11}");
-	// Restore R12
-	__asm("POP {R12}");
+	// Skip EXC_RETURN, the first thread is started without an exception return
+	__asm("ADD SP,SP,#4");
 	// Restore R0, R1, R2, R3
 	__asm("POP {R0-R3}");
-	// Skip LR
-	__asm("ADD SP,SP,#4");
-	// Pop LR to create new start location
+	// Restore R12
+	__asm("POP {R12}");
+	// Restore LR, the thread returns into ThreadExit like every other thread
 	__asm("POP {LR}");
+	// Pop the entry point into R3, R1-R3 only hold fill patterns, the argument is in R0
+	__asm("POP {R3}");
 	// Skip PSR
 	__asm("ADD SP,SP,#4");
 	// Enable global interrupts
 	__asm("CPSIE	I");
-	// Return from exception
-	__asm("BX	LR");
+	// Jump to the thread's entry point
+	__asm("BX	R3");
 }
 
 void ThreadYield(void){
-	// Clear SysTick Current Value Register
-	SysTick->VAL = 0;
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	// Give up the rest of the quanta to the equal priority peers
+	ReadyRotate();
+
+	// Trigger PendSV only if someone else is ready to run
+	KernelPreempt();
+
+	// Leave the critical section
+	// The pending PendSV is taken right here
+	KernelExitCritical(mask);
+}
 
-	// Trigger SysTick
-	// Set PENDSTSET to 1 (Ref DUI0553 p4-14)
-	INT_CTRL = (1 << 26);
+void SchedulerPriority(void){
+	// Switch to the head of the highest priority non-empty level
+	// The lookup is a single CLZ no matter how many threads are ready
+	currStackPtr = readyList[__CLZ(readyBitmap)];
+}
 
+uint32_t KernelGetTicks(void){
+	// A 32-bit aligned read is atomic on the Cortex-M4
+	return KernelTicks;
 }
 
-void SchedulerRoundRobin(void){
-	// If the number of ticks equals the configured period
-	if((++PERIOD_TICK) == PERIOD){
-		// Launch task
-		(*task3)();
-		// Set the number of ticks back to 0
-		PERIOD_TICK = 0;
+void ThreadSetPriority(tcb_t *thread, uint8_t priority){
+	uint32_t mask;
+
+	// Ignore threads and priority levels that do not exist
+	if(thread == 0 || thread->state == THREAD_FREE || priority >= NUM_PRIORITIES){
+		return;
 	}
-	// Switch to the next thread
-	currStackPtr = currStackPtr->nextStackPtr;
+	// EDF_PRIORITY belongs to ThreadCreateEDF, a thread without a deadline would top the EDF heap
+	// and starve the real EDF jobs, and an EDF thread cannot leave its level either
+	if(priority == EDF_PRIORITY || thread->basePriority == EDF_PRIORITY){
+		return;
+	}
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	ThreadChangeBasePriority(thread, priority);
+	// Switch if the change lets another thread outrank the current one
+	KernelPreempt();
+	// Leave the critical section
+	KernelExitCritical(mask);
 }
 
-void TIM2_1Hz_Interrupt_Init(void){
-	// Enable TIM2 APB1 clock
-	RCC->APB1ENR |= (1 << 0);
-	// Set TIM2 pre-scaler
-	TIM2->PSC = 1600 - 1;
-	// Set TIM2 auto-reload value
-	TIM2->ARR = 1000 - 1;
-	// Clear TIM2 counter
-	TIM2->CNT = 0;
-	// Enable TIM2 counter in the TIM2 control register
-	TIM2->CR1 = (1 << 0);
-	// Enable TIM2 interrupt in DMA/interrupt enable register
-	TIM2->DIER |= (1 << 0);
-	// Enable TIM2 interrupt in NVIC
-	NVIC_EnableIRQ(TIM2_IRQn);
+static void ThreadChangePriority(tcb_t *thread, uint32_t priority){
+	// Must be called inside a critical section
+	if(thread->priority == priority){
+		return;
+	}
+	if(thread->state == THREAD_READY){
+		// Move the thread from its old ready list to the tail of the new one
+		ReadyRemove(thread);
+		thread->priority = priority;
+		ReadyInsert(thread);
+	}
+	else if(thread->state == THREAD_BLOCKED && thread->waitQueue != 0){
+		// Re-sort the thread in the wait queue it is blocked on
+		waitqueue_t *queue = thread->waitQueue;
+		WaitQueueRemove(thread);
+		thread->priority = priority;
+		WaitQueueInsert(queue, thread);
+	}
+	else{
+		// Not queued anywhere by priority (asleep, or waiting for a notification),
+		// takes effect when it becomes ready
+		thread->priority = priority;
+	}
+}
 
+static void ThreadChangeBasePriority(tcb_t *thread, uint32_t priority){
+	// Must be called inside a critical section
+	thread->basePriority = priority;
+	// An inherited priority above the new one stays in effect until the mutex is released
+	ThreadUpdatePriority(thread);
 }
 
-void SemaphoreInit(int32_t *semaphore, int32_t value){
-	// Initialize semaphore to a value
-	*semaphore = value;
+static uint32_t ThreadEffectivePriority(tcb_t *thread){
+	// Must be called inside a critical section
+	uint32_t priority = thread->basePriority;
+
+	// Run at the ceiling of every priority-ceiling mutex the thread holds, and inherit
+	// the priority of the most urgent thread blocked on any mutex the thread holds
+	for(mutex_t *mutex = thread->heldMutexes; mutex != 0; mutex = mutex->nextHeld){
+		if(mutex->ceiling < priority){
+			priority = mutex->ceiling;
+		}
+		if(mutex->waiters.head != 0 && mutex->waiters.head->priority < priority){
+			priority = mutex->waiters.head->priority;
+		}
+	}
+	// Only EDF threads have a deadline to be ordered by in the EDF heap, a non-EDF owner
+	// that would inherit EDF_PRIORITY runs one level above it and so still ahead of the waiter
+	if(priority == EDF_PRIORITY && thread->basePriority != EDF_PRIORITY){
+		priority = EDF_PRIORITY - 1;
+	}
+	return priority;
 }
 
-void SemaphoreGive(int32_t *semaphore){
-	// Disable global interrupts
-	__disable_irq();
-	// Increment (give) semaphore
-	*semaphore += 1;
-	// Enable global interrupts
-	__enable_irq();
+static void ThreadUpdatePriority(tcb_t *thread){
+	// Must be called inside a critical section
+	// Walk the chain of owners: a raised (or lowered) thread blocked on a mutex
+	// re-sorts that mutex's wait queue and passes the change on to its owner
+	// The walk is bounded by the number of threads even if the locks form a cycle
+	for(uint32_t i = 0; i < MAX_THREADS && thread != 0; i++){
+		uint32_t priority = ThreadEffectivePriority(thread);
+
+		if(priority == thread->priority){
+			break;
+		}
+		ThreadChangePriority(thread, priority);
 
+		if(thread->state == THREAD_BLOCKED && thread->blockedMutex != 0){
+			thread = (tcb_t *)(thread->blockedMutex->lock & ~MUTEX_CONTENDED);
+		}
+		else{
+			thread = 0;
+		}
+	}
 }
 
-void SemaphoreWait(int32_t *semaphore){
-	// Disable global interrupts
-	__disable_irq();
-	// Block until semaphore is available
-	while(*semaphore <= 0){
-		// Disable global interrupts
-		__disable_irq();
-		// Enable global interrupts
-		__enable_irq();
+tcb_t *ThreadGetCurrent(void){
+	return currStackPtr;
+}
+
+static void KernelPreempt(void){
+	if(KernelPreemptNeeded()){
+		// Set PENDSVSET to 1 (Ref DUI0553 p4-14)
+		INT_CTRL = PENDSVSET;
+	}
+}
+
+static uint8_t KernelPreemptNeeded(void){
+	// Must be called inside a critical section
+	// Nothing to switch from before the kernel is launched
+	return kernelRunning && readyList[__CLZ(readyBitmap)] != currStackPtr;
+}
+
+void KernelYieldFromISR(uint8_t woken){
+	// PendSV has the lowest priority, the switch runs once every nested interrupt has returned
+	if(woken && kernelRunning){
+		INT_CTRL = PENDSVSET;
+	}
+}
+
+void ThreadWaitNextPeriod(void){
+	uint32_t mask;
+	tcb_t *thread = currStackPtr;
+
+	// Aperiodic threads have no next period
+	if(thread->period == 0){
+		return;
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	// The job is done, count it as a miss if it completed past its deadline
+	if((int32_t)(KernelTicks - thread->absDeadline) > 0){
+		thread->deadlineMisses++;
+	}
+
+	// Move on to the next job
+	// Remove first, the EDF heap is keyed by the deadline that is about to change
+	ReadyRemove(thread);
+	thread->release += thread->period;
+	thread->absDeadline = thread->release + thread->relDeadline;
+
+	if((int32_t)(KernelTicks - thread->release) >= 0){
+		// Overrun, the next job is already released
+		ReadyInsert(thread);
+	}
+	else{
+		// Sleep until the next period starts
+		thread->state = THREAD_DELAYED;
+		DelayInsert(thread, thread->release - KernelTicks);
+	}
+	KernelPreempt();
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+uint32_t ThreadGetDeadlineMisses(tcb_t *thread){
+	return thread->deadlineMisses;
+}
+
+void ThreadSleep(uint32_t ticks){
+	uint32_t mask;
+
+	// Nothing to wait for, just let the equal priority peers run
+	if(ticks == 0){
+		ThreadYield();
+		return;
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(currStackPtr->wakePending){
+		// ThreadWake came in before the sleep, skip it
+		currStackPtr->wakePending = 0;
+	}
+	else{
+		// Leave the ready set and park in the delta list
+		ReadyRemove(currStackPtr);
+		currStackPtr->state = THREAD_DELAYED;
+		DelayInsert(currStackPtr, ticks);
+		// Switch away, PendSV runs as soon as interrupts are enabled
+		INT_CTRL = PENDSVSET;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+void ThreadWake(tcb_t *thread){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(thread->state == THREAD_DELAYED){
+		// End the sleep now
+		DelayRemove(thread);
+		thread->state = THREAD_READY;
+		ReadyInsert(thread);
+		KernelPreempt();
+	}
+	else{
+		// Not asleep yet, remember the wakeup for its next sleep
+		thread->wakePending = 1;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+void ThreadNotify(tcb_t *thread, uint32_t value, uint8_t action){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(NotifyApply(thread, value, action)){
+		// Switch if the woken thread outranks the current one
+		KernelPreempt();
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+void ThreadNotifyFromISR(tcb_t *thread, uint32_t value, uint8_t action, uint8_t *woken){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	// Leave the switch to KernelYieldFromISR, once per interrupt
+	if(NotifyApply(thread, value, action) && woken != 0 && KernelPreemptNeeded()){
+		*woken = 1;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+uint32_t ThreadNotifyWait(uint32_t clearBits){
+	tcb_t *thread = currStackPtr;
+	uint32_t mask;
+	uint32_t value;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(thread->notifyState != NOTIFY_PENDING){
+		// Nothing yet, leave the ready set until ThreadNotify readies us
+		// No wait queue, the notifier finds the thread through its handle
+		ReadyRemove(thread);
+		thread->state = THREAD_BLOCKED;
+		thread->notifyState = NOTIFY_WAITING;
+		INT_CTRL = PENDSVSET;
+		// Leave the critical section, the switch happens here
+		KernelExitCritical(mask);
+		// Enter a critical section
+		mask = KernelEnterCritical();
+	}
+	// Consume the notification
+	value = thread->notifyValue;
+	thread->notifyValue &= ~clearBits;
+	thread->notifyState = NOTIFY_NONE;
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return value;
+}
+
+static uint8_t NotifyApply(tcb_t *thread, uint32_t value, uint8_t action){
+	// Must be called inside a critical section
+	// Update the notification word
+	if(action == NOTIFY_SET_BITS){
+		thread->notifyValue |= value;
+	}
+	else if(action == NOTIFY_INCREMENT){
+		thread->notifyValue++;
+	}
+	else{
+		thread->notifyValue = value;
+	}
+
+	if(thread->notifyState == NOTIFY_WAITING){
+		// Ready the waiting thread, no wait queue to take it out of
+		thread->notifyState = NOTIFY_PENDING;
+		thread->state = THREAD_READY;
+		ReadyInsert(thread);
+		return 1;
+	}
+	thread->notifyState = NOTIFY_PENDING;
+	return 0;
+}
+
+void ThreadSleepUntil(uint32_t wakeTick){
+	// Sleep for the remaining ticks, a wakeup time in the past only yields
+	int32_t ticks = (int32_t)(wakeTick - KernelTicks);
+	ThreadSleep(ticks > 0 ? (uint32_t)ticks : 0);
+}
+
+static void DelayInsert(tcb_t *thread, uint32_t ticks){
+	// Must be called inside a critical section
+	tcb_t **pos = &delayList;
+
+	// Walk past the sleepers that wake up earlier (or at the same tick, FIFO),
+	// turning the delay into one relative to the entry in front
+	while(*pos != 0 && (*pos)->delayTicks <= ticks){
+		ticks -= (*pos)->delayTicks;
+		pos = &(*pos)->delayNextPtr;
+	}
+	thread->delayTicks = ticks;
+	thread->delayNextPtr = *pos;
+	// The entry behind now waits relative to the new thread
+	if(*pos != 0){
+		(*pos)->delayTicks -= ticks;
+	}
+	*pos = thread;
+}
+
+static void DelayRemove(tcb_t *thread){
+	// Must be called inside a critical section
+	tcb_t **pos = &delayList;
+
+	while(*pos != 0){
+		if(*pos == thread){
+			// The entry behind inherits the remaining delay
+			if(thread->delayNextPtr != 0){
+				thread->delayNextPtr->delayTicks += thread->delayTicks;
+			}
+			*pos = thread->delayNextPtr;
+			return;
+		}
+		pos = &(*pos)->delayNextPtr;
+	}
+}
+
+static void ReadyRotate(void){
+	// Round-robin within a priority level, the EDF level is ordered by deadline instead
+	if(currStackPtr->priority != EDF_PRIORITY && readyList[currStackPtr->priority] == currStackPtr){
+		readyList[currStackPtr->priority] = currStackPtr->nextPtr;
+	}
+}
+
+static uint8_t EdfEarlier(tcb_t *a, tcb_t *b){
+	// Compare absolute deadlines, wrap-around safe
+	return (int32_t)(a->absDeadline - b->absDeadline) < 0;
+}
+
+static void EdfSwap(uint32_t i, uint32_t j){
+	tcb_t *temp = edfHeap[i];
+	edfHeap[i] = edfHeap[j];
+	edfHeap[j] = temp;
+	edfHeap[i]->heapIndex = i;
+	edfHeap[j]->heapIndex = j;
+}
+
+static void EdfSiftUp(uint32_t i){
+	// Move the entry up while it has an earlier deadline than its parent
+	while(i > 0 && EdfEarlier(edfHeap[i], edfHeap[(i - 1) / 2])){
+		EdfSwap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
-	// Decrement semaphore
-	*semaphore -= 1;
-	// Enable global interrupts
-	__enable_irq();
 }
 
+static void EdfSiftDown(uint32_t i){
+	// Move the entry down while one of its children has an earlier deadline
+	while(1){
+		uint32_t earliest = i;
+		uint32_t left = 2 * i + 1;
+		uint32_t right = 2 * i + 2;
+
+		if(left < edfCount && EdfEarlier(edfHeap[left], edfHeap[earliest])){
+			earliest = left;
+		}
+		if(right < edfCount && EdfEarlier(edfHeap[right], edfHeap[earliest])){
+			earliest = right;
+		}
+		if(earliest == i){
+			break;
+		}
+		EdfSwap(i, earliest);
+		i = earliest;
+	}
+}
+
+static void EdfInsert(tcb_t *thread){
+	// Append at the bottom and restore the heap order, O(log n)
+	thread->heapIndex = edfCount;
+	edfHeap[edfCount++] = thread;
+	EdfSiftUp(thread->heapIndex);
+}
+
+static void EdfRemove(tcb_t *thread){
+	uint32_t i = thread->heapIndex;
+
+	// Fill the hole with the last entry and restore the heap order, O(log n)
+	edfCount--;
+	if(i != edfCount){
+		edfHeap[i] = edfHeap[edfCount];
+		edfHeap[i]->heapIndex = i;
+		EdfSiftUp(i);
+		EdfSiftDown(edfHeap[i]->heapIndex);
+	}
+}
+
+static void ReadyInsert(tcb_t *thread){
+	tcb_t *head = readyList[thread->priority];
+
+	if(thread->priority == EDF_PRIORITY){
+		// The EDF level is a heap, its head is the earliest deadline
+		EdfInsert(thread);
+		readyList[EDF_PRIORITY] = edfHeap[0];
+		readyBitmap |= (1U << (31 - EDF_PRIORITY));
+		return;
+	}
+
+	if(head == 0){
+		// First thread at this level, it forms a ring of one
+		thread->nextPtr = thread;
+		thread->prevPtr = thread;
+		readyList[thread->priority] = thread;
+		// Mark the priority level as ready
+		readyBitmap |= (1U << (31 - thread->priority));
+	}
+	else{
+		// Link in at the tail so it runs after the threads already waiting at this level
+		thread->nextPtr = head;
+		thread->prevPtr = head->prevPtr;
+		head->prevPtr->nextPtr = thread;
+		head->prevPtr = thread;
+	}
+}
+
+static void ReadyRemove(tcb_t *thread){
+	if(thread->priority == EDF_PRIORITY){
+		// Take the thread out of the heap, the level is empty with the last one
+		EdfRemove(thread);
+		if(edfCount == 0){
+			readyList[EDF_PRIORITY] = 0;
+			readyBitmap &= ~(1U << (31 - EDF_PRIORITY));
+		}
+		else{
+			readyList[EDF_PRIORITY] = edfHeap[0];
+		}
+		return;
+	}
+
+	if(thread->nextPtr == thread){
+		// Last thread at this level, clear the level from the bitmap
+		readyList[thread->priority] = 0;
+		readyBitmap &= ~(1U << (31 - thread->priority));
+	}
+	else{
+		// Unlink from the ring and advance the head if it was pointing at this thread
+		thread->prevPtr->nextPtr = thread->nextPtr;
+		thread->nextPtr->prevPtr = thread->prevPtr;
+		if(readyList[thread->priority] == thread){
+			readyList[thread->priority] = thread->nextPtr;
+		}
+	}
+}
+
+static void WaitQueueInsert(waitqueue_t *queue, tcb_t *thread){
+	tcb_t *head = queue->head;
+	tcb_t *pos;
+
+	thread->waitQueue = queue;
+
+	if(head == 0){
+		// First waiter, it forms a ring of one
+		thread->nextPtr = thread;
+		thread->prevPtr = thread;
+		queue->head = thread;
+		return;
+	}
+
+	// Find the first waiter with a lower priority, equal priorities stay in FIFO order
+	pos = head;
+	do{
+		if(pos->priority > thread->priority){
+			break;
+		}
+		pos = pos->nextPtr;
+	}while(pos != head);
+
+	// Link in before that waiter (or at the tail if there is none)
+	thread->nextPtr = pos;
+	thread->prevPtr = pos->prevPtr;
+	pos->prevPtr->nextPtr = thread;
+	pos->prevPtr = thread;
+
+	// A new highest priority waiter becomes the head
+	if(pos == head && thread->priority < head->priority){
+		queue->head = thread;
+	}
+}
+
+static void WaitQueueRemove(tcb_t *thread){
+	waitqueue_t *queue = thread->waitQueue;
+
+	if(thread->nextPtr == thread){
+		// Last waiter
+		queue->head = 0;
+	}
+	else{
+		// Unlink from the ring and advance the head if it was pointing at this thread
+		thread->prevPtr->nextPtr = thread->nextPtr;
+		thread->nextPtr->prevPtr = thread->prevPtr;
+		if(queue->head == thread){
+			queue->head = thread->nextPtr;
+		}
+	}
+	thread->waitQueue = 0;
+}
+
+static void KernelBlock(waitqueue_t *queue){
+	// Must be called inside a critical section
+	// Take the current thread out of the ready set and park it in the wait queue
+	ReadyRemove(currStackPtr);
+	currStackPtr->state = THREAD_BLOCKED;
+	WaitQueueInsert(queue, currStackPtr);
+	// Switch away, PendSV runs as soon as the caller enables interrupts
+	INT_CTRL = PENDSVSET;
+}
+
+static void KernelBlockTimeout(waitqueue_t *queue, uint32_t timeout){
+	// Must be called inside a critical section
+	KernelBlock(queue);
+	currStackPtr->waitTimedOut = 0;
+	// Also sleep in the delta list, the tick takes the thread off the wait queue if it runs out
+	if(timeout != WAIT_FOREVER){
+		currStackPtr->timedWait = 1;
+		DelayInsert(currStackPtr, timeout);
+	}
+}
+
+static tcb_t *KernelWake(waitqueue_t *queue){
+	// Must be called inside a critical section
+	tcb_t *thread = queue->head;
+
+	if(thread != 0){
+		// Move the highest priority waiter back into the ready set
+		KernelWakeThread(thread);
+	}
+	return thread;
+}
+
+static void KernelWakeThread(tcb_t *thread){
+	// Must be called inside a critical section
+	WaitQueueRemove(thread);
+	// The wait is satisfied, cancel its timeout
+	if(thread->timedWait){
+		DelayRemove(thread);
+		thread->timedWait = 0;
+	}
+	thread->state = THREAD_READY;
+	ReadyInsert(thread);
+}
+
+uint8_t KernelAddPeriodicJob(void (*job)(void), uint32_t period, uint32_t phase){
+	uint32_t mask;
+	uint8_t added = 0;
+	uint32_t since, late, g;
+
+	// Reject jobs that can never run
+	if(job == 0 || period == 0){
+		return 0;
+	}
+
+	// Spread the job away from the ones already registered
+	// The search only reads the table, keep it out of the critical section
+	if(phase == PERIODIC_PHASE_AUTO){
+		phase = PeriodicAutoPhase(period);
+	}
+	phase %= period;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	for(uint32_t i = 0; i < MAX_PERIODIC_JOBS; i++){
+		if(periodicJobs[i].job == 0){
+			periodicJobs[i].period = period;
+			periodicJobs[i].phase = phase;
+			// First run on the job's grid at or after the current tick
+			// The grid counts from the anchor rather than from tick 0: KernelTicks % period
+			// jumps when the count wraps at 2^32 unless period divides 2^32, which would put
+			// jobs added after the wrap out of step with the phases picked before it
+			since = KernelTicks - periodicAnchor;
+			late = since % period;
+			periodicJobs[i].nextDue = KernelTicks + (phase >= late ? phase - late : phase + (period - late));
+			periodicJobs[i].job = job;
+			periodicCount++;
+			// The anchor can move by multiples of every period now registered
+			if(periodicHyperperiod != 0){
+				g = Gcd(periodicHyperperiod, period);
+				periodicHyperperiod = (periodicHyperperiod / g <= 0xFFFFFFFF / period) ? periodicHyperperiod / g * period : 0;
+			}
+			PeriodicUpdateNextDue();
+			added = 1;
+			break;
+		}
+	}
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return added;
+}
+
+static void PeriodicThread(void *arg){
+	uint32_t mask;
+	uint32_t since;
+
+	while(1){
+		// Sleep until the tick reports a due job
+		SemaphoreWait(&periodicSignal);
+
+		for(uint32_t i = 0; i < MAX_PERIODIC_JOBS; i++){
+			periodic_job_t *entry = &periodicJobs[i];
+
+			if(entry->job != 0 && (int32_t)(KernelTicks - entry->nextDue) >= 0){
+				// Run the job with interrupts enabled
+				entry->job();
+				// Schedule the next run on the job's grid, skipping runs that were missed
+				do{
+					entry->nextDue += entry->period;
+				}while((int32_t)(KernelTicks - entry->nextDue) >= 0);
+			}
+		}
+
+		// Enter a critical section
+		mask = KernelEnterCritical();
+		// Keep the anchor within a hyperperiod of the tick, so that KernelTicks - periodicAnchor
+		// never wraps and new jobs stay on the grid of the old ones. Moving it by whole
+		// hyperperiods leaves every registered job's grid where it was. Without a 32-bit
+		// hyperperiod it stays put, and a job added 2^32 ticks later may land on a used phase
+		since = KernelTicks - periodicAnchor;
+		if(periodicHyperperiod != 0 && since >= periodicHyperperiod){
+			periodicAnchor += since - since % periodicHyperperiod;
+		}
+		// Let the tick look for the next due job
+		PeriodicUpdateNextDue();
+		periodicPending = 0;
+		// Leave the critical section
+		KernelExitCritical(mask);
+	}
+}
+
+static void PeriodicUpdateNextDue(void){
+	// Must be called inside a critical section
+	uint32_t earliest = 0;
+	uint8_t found = 0;
+
+	for(uint32_t i = 0; i < MAX_PERIODIC_JOBS; i++){
+		if(periodicJobs[i].job != 0 && (!found || (int32_t)(periodicJobs[i].nextDue - earliest) < 0)){
+			earliest = periodicJobs[i].nextDue;
+			found = 1;
+		}
+	}
+	periodicNextDue = earliest;
+}
+
+static uint32_t PeriodicAutoPhase(uint32_t period){
+	// Jobs (T1, P1) and (T2, P2) meet on some tick exactly when P1 - P2 is a multiple of gcd(T1, T2)
+	// The phases are anchor offsets, so the test holds over the whole hyperperiod whatever KernelTicks is
+	// Only the phase modulo each gcd matters: the search stops at their lcm, a divisor of the period
+	uint32_t g[MAX_PERIODIC_JOBS];
+	uint32_t residue[MAX_PERIODIC_JOBS];
+	uint32_t n = 0;
+	uint32_t span = 1;
+	uint32_t bestPhase = 0;
+	uint32_t bestCollisions = MAX_PERIODIC_JOBS + 1;
+
+	for(uint32_t i = 0; i < MAX_PERIODIC_JOBS; i++){
+		if(periodicJobs[i].job != 0){
+			g[n] = Gcd(period, periodicJobs[i].period);
+			residue[n] = periodicJobs[i].phase % g[n];
+			span = span / Gcd(span, g[n]) * g[n];
+			n++;
+		}
+	}
+
+	// Pick the phase that meets the fewest registered jobs, the earliest one on a tie
+	for(uint32_t phase = 0; phase < span && bestCollisions != 0; phase++){
+		uint32_t collisions = 0;
+
+		for(uint32_t k = 0; k < n; k++){
+			if(phase % g[k] == residue[k]){
+				collisions++;
+			}
+		}
+		if(collisions < bestCollisions){
+			bestCollisions = collisions;
+			bestPhase = phase;
+		}
+	}
+	return bestPhase;
+}
+
+static uint32_t Gcd(uint32_t a, uint32_t b){
+	// Euclid's algorithm
+	while(b != 0){
+		uint32_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+static void IdleThread(void *arg){
+	while(1){
+		IdleCount++;
+#if KERNEL_TICKLESS
+		// Sleep through the ticks nobody needs
+		KernelIdleSleep();
+#endif
+	}
+}
+
+#if KERNEL_TICKLESS
+static uint32_t KernelNextWakeup(void){
+	// Ticks until the next timed kernel event, as far as the counter can go
+	uint32_t ticks = 0xFFFFFFFF;
+
+	// The next periodic job
+	if(periodicCount != 0 && !periodicPending){
+		ticks = periodicNextDue - KernelTicks;
+	}
+	// or the first sleeping thread, whichever comes first
+	if(delayList != 0 && delayList->delayTicks < ticks){
+		ticks = delayList->delayTicks;
+	}
+	return ticks;
+}
+
+static void KernelIdleSleep(void){
+	uint32_t idleTicks, remaining, reload, elapsed, completed, ctrl;
+
+	// Disable global interrupts
+	// PRIMASK rather than BASEPRI: WFI only wakes up for interrupts above the BASEPRI mask,
+	// but still wakes up on any pending interrupt while PRIMASK is set
+	// It is taken once interrupts are enabled again, after the tick count is corrected
+	__disable_irq();
+
+	// Only the idle thread is ready, anything else means there is work to do
+	if(readyBitmap != (1U << (31 - LOWEST_PRIORITY)) || currStackPtr->nextPtr != currStackPtr){
+		__enable_irq();
+		return;
+	}
+
+	// Sleep until the next timed event, as far as the 24-bit SysTick counter reaches
+	idleTicks = KernelNextWakeup();
+	if(idleTicks > SYSTICK_MAX_LOAD / tickReload){
+		idleTicks = SYSTICK_MAX_LOAD / tickReload;
+	}
+	// The next tick is due anyway, nothing to gain
+	if(idleTicks < 2){
+		__enable_irq();
+		return;
+	}
+
+	// Stop SysTick and stretch the current tick over the idle period
+	SysTick->CTRL &= ~(1U << 0);
+	remaining = SysTick->VAL;
+	reload = remaining + (idleTicks - 1) * tickReload;
+	SysTick->LOAD = reload - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL |= (1U << 0);
+
+	// Sleep until SysTick or any other interrupt fires
+	__DSB();
+	__WFI();
+	__ISB();
+
+	// Stop SysTick to account for the time spent asleep
+	// Reading CTRL clears COUNTFLAG, so read it once and stop the counter with a plain write
+	ctrl = SysTick->CTRL;
+	SysTick->CTRL = ctrl & ~(1U << 0);
+
+	if(ctrl & SysTick_CTRL_COUNTFLAG_Msk){
+		// Slept the whole period, the pending SysTick interrupt accounts for the last tick
+		completed = idleTicks - 1;
+		// Next tick one full quanta from now
+		SysTick->LOAD = tickReload - 1;
+	}
+	else{
+		// Woken early by another interrupt, count the tick boundaries already passed
+		elapsed = reload - SysTick->VAL;
+		if(elapsed < remaining){
+			completed = 0;
+			SysTick->LOAD = remaining - elapsed - 1;
+		}
+		else{
+			completed = 1 + (elapsed - remaining) / tickReload;
+			SysTick->LOAD = tickReload - ((elapsed - remaining) % tickReload) - 1;
+		}
+	}
+	// Restart SysTick for the rest of the current tick
+	SysTick->VAL = 0;
+	SysTick->CTRL |= (1U << 0);
+
+	// Correct the tick count for the ticks that were skipped
+	KernelTicks += completed;
+	// The sleep never outlasts the first sleeper, it stays in the list
+	if(delayList != 0){
+		delayList->delayTicks -= completed;
+	}
+
+	// From the next reload on, ticks last one quanta again
+	SysTick->LOAD = tickReload - 1;
+
+	// Enable global interrupts
+	__enable_irq();
+}
+#endif
+
+void TIM2_1Hz_Interrupt_Init(void){
+	// Enable TIM2 APB1 clock
+	RCC->APB1ENR |= (1 << 0);
+	// Set TIM2 pre-scaler
+	TIM2->PSC = 1600 - 1;
+	// Set TIM2 auto-reload value
+	TIM2->ARR = 1000 - 1;
+	// Clear TIM2 counter
+	TIM2->CNT = 0;
+	// Enable TIM2 counter in the TIM2 control register
+	TIM2->CR1 = (1 << 0);
+	// Enable TIM2 interrupt in DMA/interrupt enable register
+	TIM2->DIER |= (1 << 0);
+	// Allow the TIM2 handler to call the FromISR kernel functions
+	NVIC_SetPriority(TIM2_IRQn, KERNEL_MAX_SYSCALL_PRIORITY);
+	// Enable TIM2 interrupt in NVIC
+	NVIC_EnableIRQ(TIM2_IRQn);
+
+}
+
+void SemaphoreInit(semaphore_t *semaphore, int32_t value){
+	// Initialize semaphore to a value
+	semaphore->count = value;
+	// No thread is waiting yet
+	semaphore->wakeups = 0;
+	semaphore->waiters.head = 0;
+}
+
+void SemaphoreGive(semaphore_t *semaphore){
+	int32_t count;
+
+	// Increment (give) semaphore with an exclusive store
+	// An interrupt or context switch in between clears the exclusive monitor and the store is retried
+	do{
+		count = (int32_t)__LDREXW((volatile uint32_t *)&semaphore->count);
+	}while(__STREXW((uint32_t)(count + 1), (volatile uint32_t *)&semaphore->count) != 0);
+
+	// A negative count is the number of threads waiting, one of them has to be woken
+	if(count < 0){
+		SemaphoreGiveSlow(semaphore);
+	}
+}
+
+void SemaphoreWait(semaphore_t *semaphore){
+	int32_t count;
+
+	// Decrement (wait on) semaphore with an exclusive store
+	do{
+		count = (int32_t)__LDREXW((volatile uint32_t *)&semaphore->count);
+	}while(__STREXW((uint32_t)(count - 1), (volatile uint32_t *)&semaphore->count) != 0);
+
+	// No unit was available, the decrement registered us as a waiter
+	if(count <= 0){
+		SemaphoreWaitSlow(semaphore);
+	}
+}
+
+void SemaphoreGiveFromISR(semaphore_t *semaphore, uint8_t *woken){
+	int32_t count;
+	uint32_t mask;
+
+	// Increment (give) semaphore with an exclusive store, as in SemaphoreGive
+	do{
+		count = (int32_t)__LDREXW((volatile uint32_t *)&semaphore->count);
+	}while(__STREXW((uint32_t)(count + 1), (volatile uint32_t *)&semaphore->count) != 0);
+
+	if(count < 0){
+		// Enter a critical section
+		mask = KernelEnterCritical();
+		if(semaphore->waiters.head != 0){
+			// Hand the unit straight to the highest priority waiter
+			KernelWake(&semaphore->waiters);
+			// Leave the switch to KernelYieldFromISR, once per interrupt
+			if(woken != 0 && KernelPreemptNeeded()){
+				*woken = 1;
+			}
+		}
+		else{
+			// The waiter has counted itself but not blocked yet, leave it a wakeup
+			semaphore->wakeups++;
+		}
+		// Leave the critical section
+		KernelExitCritical(mask);
+	}
+}
+
+static void SemaphoreGiveSlow(semaphore_t *semaphore){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(semaphore->waiters.head != 0){
+		// Hand the unit straight to the highest priority waiter
+		KernelWake(&semaphore->waiters);
+		// Switch if the woken thread outranks the current one
+		KernelPreempt();
+	}
+	else{
+		// The waiter has counted itself but not blocked yet, leave it a wakeup
+		semaphore->wakeups++;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+static void SemaphoreWaitSlow(semaphore_t *semaphore){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(semaphore->wakeups > 0){
+		// A give came in between our decrement and here, the unit is ours
+		semaphore->wakeups--;
+	}
+	else{
+		// Block until SemaphoreGive hands over a unit
+		KernelBlock(&semaphore->waiters);
+	}
+	// Leave the critical section
+	// When blocking, the switch happens here and the thread resumes once it owns a unit
+	KernelExitCritical(mask);
+}
+
+void MutexInit(mutex_t *mutex){
+	// Free, not owned by any thread
+	mutex->lock = 0;
+	mutex->count = 0;
+	mutex->waiters.head = 0;
+	mutex->nextHeld = 0;
+	mutex->nextOwned = 0;
+	// Priority inheritance only
+	mutex->ceiling = MUTEX_NO_CEILING;
+}
+
+void MutexInitCeiling(mutex_t *mutex, uint8_t ceiling){
+	MutexInit(mutex);
+	// Immediate priority ceiling, the owner runs at this priority while it holds the mutex
+	if(ceiling < NUM_PRIORITIES){
+		mutex->ceiling = ceiling;
+	}
+}
+
+void MutexLock(mutex_t *mutex){
+	uint32_t self = (uint32_t)currStackPtr;
+
+	// The owner locks again, only it touches the recursion count
+	if((mutex->lock & ~MUTEX_CONTENDED) == self){
+		mutex->count++;
+		return;
+	}
+
+	// Raising the owner to the ceiling takes the kernel
+	if(mutex->ceiling != MUTEX_NO_CEILING){
+		MutexLockSlow(mutex);
+		return;
+	}
+
+	// Claim a free mutex with an exclusive store, no need to enter the kernel
+	// A context switch clears the exclusive monitor, so a preempted attempt just retries
+	do{
+		if(__LDREXW(&mutex->lock) != 0){
+			// Owned by another thread, block in the kernel
+			__CLREX();
+			MutexLockSlow(mutex);
+			return;
+		}
+	}while(__STREXW(self, &mutex->lock) != 0);
+	// Keep the protected accesses after the lock is taken
+	__DMB();
+	mutex->count = 1;
+	MutexOwnedAdd(currStackPtr, mutex);
+}
+
+uint8_t MutexTryLock(mutex_t *mutex){
+	uint32_t mask;
+	uint32_t self = (uint32_t)currStackPtr;
+
+	// The owner locks again
+	if((mutex->lock & ~MUTEX_CONTENDED) == self){
+		mutex->count++;
+		return 1;
+	}
+
+	if(mutex->ceiling != MUTEX_NO_CEILING){
+		uint8_t taken = 0;
+
+		// Enter a critical section
+		mask = KernelEnterCritical();
+		if(mutex->lock == 0){
+			// Take it and go up to the ceiling
+			MutexTake(mutex);
+			taken = 1;
+		}
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return taken;
+	}
+
+	// Claim a free mutex with an exclusive store, give up if it is owned
+	do{
+		if(__LDREXW(&mutex->lock) != 0){
+			__CLREX();
+			return 0;
+		}
+	}while(__STREXW(self, &mutex->lock) != 0);
+	// Keep the protected accesses after the lock is taken
+	__DMB();
+	mutex->count = 1;
+	MutexOwnedAdd(currStackPtr, mutex);
+	return 1;
+}
+
+void MutexUnlock(mutex_t *mutex){
+	uint32_t self = (uint32_t)currStackPtr;
+
+	// Only the owner can unlock
+	if((mutex->lock & ~MUTEX_CONTENDED) != self){
+		return;
+	}
+	// Still locked by an outer MutexLock of the owner
+	if(mutex->count > 1){
+		mutex->count--;
+		return;
+	}
+
+	// Keep the protected accesses before the lock is released
+	__DMB();
+	mutex->count = 0;
+	MutexOwnedRemove(currStackPtr, mutex);
+	// Coming down from the ceiling takes the kernel
+	if(mutex->ceiling != MUTEX_NO_CEILING){
+		MutexUnlockSlow(mutex);
+		return;
+	}
+	// Release with an exclusive store while nobody is waiting, no need to enter the kernel
+	do{
+		if(__LDREXW(&mutex->lock) != self){
+			// Waiters are queued, hand the mutex over in the kernel
+			__CLREX();
+			MutexUnlockSlow(mutex);
+			return;
+		}
+	}while(__STREXW(0, &mutex->lock) != 0);
+}
+
+static void MutexTake(mutex_t *mutex){
+	// Must be called inside a critical section
+	mutex->lock = (uint32_t)currStackPtr;
+	mutex->count = 1;
+	MutexOwnedAdd(currStackPtr, mutex);
+	if(mutex->ceiling != MUTEX_NO_CEILING){
+		// Go up to the ceiling right away, no thread that uses the mutex can preempt us now
+		mutex->nextHeld = currStackPtr->heldMutexes;
+		currStackPtr->heldMutexes = mutex;
+		ThreadUpdatePriority(currStackPtr);
+	}
+}
+
+static void MutexLockSlow(mutex_t *mutex){
+	uint32_t mask;
+	tcb_t *owner;
+	uint32_t lock;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	lock = mutex->lock;
+	if(lock == 0){
+		// Free (or released in the meantime), take it
+		MutexTake(mutex);
+	}
+	else{
+		owner = (tcb_t *)(lock & ~MUTEX_CONTENDED);
+		// First waiter: flag the lock word so that the owner's unlock enters the kernel,
+		// and add the mutex to the ones the owner inherits priority through
+		// A ceiling mutex is already there, a thread only gets here if the ceiling
+		// is not above every thread that uses it
+		if((lock & MUTEX_CONTENDED) == 0){
+			mutex->lock = lock | MUTEX_CONTENDED;
+			if(mutex->ceiling == MUTEX_NO_CEILING){
+				mutex->nextHeld = owner->heldMutexes;
+				owner->heldMutexes = mutex;
+			}
+		}
+		// Block until MutexUnlockSlow hands the mutex over
+		currStackPtr->blockedMutex = mutex;
+		KernelBlock(&mutex->waiters);
+		// Lend our priority to the owner, and on to whatever the owner is blocked on
+		ThreadUpdatePriority(owner);
+	}
+
+	// Leave the critical section
+	// When blocking, the switch happens here and the thread resumes as the owner
+	KernelExitCritical(mask);
+}
+
+static void MutexUnlockSlow(mutex_t *mutex){
+	uint32_t mask;
+	tcb_t *owner = currStackPtr;
+	tcb_t *waiter;
+	mutex_t **pos;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	// The mutex no longer lends the owner any priority
+	for(pos = &owner->heldMutexes; *pos != 0; pos = &(*pos)->nextHeld){
+		if(*pos == mutex){
+			*pos = mutex->nextHeld;
+			break;
+		}
+	}
+
+	// Hand the mutex straight to the highest priority waiter
+	waiter = KernelWake(&mutex->waiters);
+	if(waiter == 0){
+		// Uncontended ceiling mutex, just release it
+		mutex->lock = 0;
+	}
+	else{
+		waiter->blockedMutex = 0;
+		mutex->count = 1;
+		// The waiter is blocked, nothing else touches its owned list
+		MutexOwnedAdd(waiter, mutex);
+		mutex->lock = (uint32_t)waiter;
+		if(mutex->waiters.head != 0){
+			// More waiters, keep the unlock in the kernel
+			mutex->lock |= MUTEX_CONTENDED;
+		}
+		if(mutex->waiters.head != 0 || mutex->ceiling != MUTEX_NO_CEILING){
+			// The new owner inherits from the remaining waiters, or runs at the ceiling
+			mutex->nextHeld = waiter->heldMutexes;
+			waiter->heldMutexes = mutex;
+		}
+		ThreadUpdatePriority(waiter);
+	}
+
+	// Drop back to the base priority (or what other held mutexes still lend)
+	ThreadUpdatePriority(owner);
+	// Switch if the new owner outranks the current thread
+	KernelPreempt();
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+static void MutexOwnedAdd(tcb_t *thread, mutex_t *mutex){
+	// Only the owner touches its list, or MutexUnlockSlow while the new owner is blocked
+	mutex->nextOwned = thread->ownedMutexes;
+	thread->ownedMutexes = mutex;
+}
+
+static void MutexOwnedRemove(tcb_t *thread, mutex_t *mutex){
+	mutex_t **pos;
+
+	// Mutexes are mostly unlocked in reverse order, the walk usually stops at the head
+	for(pos = &thread->ownedMutexes; *pos != 0; pos = &(*pos)->nextOwned){
+		if(*pos == mutex){
+			*pos = mutex->nextOwned;
+			break;
+		}
+	}
+}
+
+void EventGroupInit(eventgroup_t *group){
+	// All flags clear, nobody waiting
+	group->flags = 0;
+	group->waiters.head = 0;
+}
+
+uint32_t EventGroupWait(eventgroup_t *group, uint32_t bits, uint8_t options){
+	uint32_t mask;
+	uint32_t result;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(EventSatisfied(group->flags, bits, options)){
+		// Already set, no need to block
+		result = group->flags;
+		if(options & EVENT_CLEAR){
+			group->flags &= ~bits;
+		}
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return result;
+	}
+
+	// Block until EventGroupSet satisfies the wait, it leaves the result in our TCB
+	currStackPtr->eventBits = bits;
+	currStackPtr->eventOptions = options;
+	KernelBlock(&group->waiters);
+	// Leave the critical section
+	// The switch happens here and the thread resumes with the wait satisfied
+	KernelExitCritical(mask);
+
+	return currStackPtr->eventResult;
+}
+
+uint32_t EventGroupSet(eventgroup_t *group, uint32_t bits){
+	uint32_t mask;
+	uint32_t flags;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	group->flags |= bits;
+	flags = group->flags;
+	if(EventGroupRelease(group)){
+		// Switch if a woken thread outranks the current one
+		KernelPreempt();
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return flags;
+}
+
+uint32_t EventGroupSetFromISR(eventgroup_t *group, uint32_t bits, uint8_t *woken){
+	uint32_t mask;
+	uint32_t flags;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	group->flags |= bits;
+	flags = group->flags;
+	// Leave the switch to KernelYieldFromISR, once per interrupt
+	if(EventGroupRelease(group) && woken != 0 && KernelPreemptNeeded()){
+		*woken = 1;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return flags;
+}
+
+uint32_t EventGroupClear(eventgroup_t *group, uint32_t bits){
+	uint32_t mask;
+	uint32_t flags;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	flags = group->flags;
+	group->flags &= ~bits;
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return flags;
+}
+
+uint32_t EventGroupGet(eventgroup_t *group){
+	// A 32-bit aligned read is atomic on the Cortex-M4
+	return group->flags;
+}
+
+static uint8_t EventSatisfied(uint32_t flags, uint32_t bits, uint8_t options){
+	if(options & EVENT_WAIT_ALL){
+		// Every flag waited for is set
+		return (flags & bits) == bits;
+	}
+	// At least one flag waited for is set
+	return (flags & bits) != 0;
+}
+
+static uint8_t EventGroupRelease(eventgroup_t *group){
+	// Must be called inside a critical section
+	tcb_t *thread = group->waiters.head;
+	tcb_t *last, *next;
+	uint32_t clear = 0;
+	uint8_t woken = 0;
+	uint8_t done = 0;
+
+	if(thread == 0){
+		return 0;
+	}
+
+	// One pass over the waiters, highest priority first, waking every satisfied one
+	// Auto-clear is applied after the pass so that all waiters see the same flags
+	last = thread->prevPtr;
+	while(!done){
+		next = thread->nextPtr;
+		done = (thread == last);
+		if(EventSatisfied(group->flags, thread->eventBits, thread->eventOptions)){
+			thread->eventResult = group->flags;
+			if(thread->eventOptions & EVENT_CLEAR){
+				clear |= thread->eventBits;
+			}
+			KernelWakeThread(thread);
+			woken = 1;
+		}
+		thread = next;
+	}
+	group->flags &= ~clear;
+
+	return woken;
+}
+
+void MsgQueueInit(msgqueue_t *queue, void *buffer, uint32_t itemSize, uint32_t capacity){
+	// Empty ring over the caller's buffer
+	queue->buffer = (uint8_t *)buffer;
+	queue->itemSize = itemSize;
+	queue->capacity = capacity;
+	queue->count = 0;
+	queue->head = 0;
+	queue->tail = 0;
+	// Nobody waiting yet
+	queue->receivers.head = 0;
+	queue->senders.head = 0;
+}
+
+uint8_t MsgQueueSend(msgqueue_t *queue, const void *item, uint32_t timeout){
+	uint32_t mask;
+	uint8_t woken = 0;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(MsgQueuePut(queue, item, &woken)){
+		// Switch if a woken receiver outranks the current thread
+		if(woken){
+			KernelPreempt();
+		}
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return 1;
+	}
+	if(timeout == 0){
+		// Full and not allowed to wait
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return 0;
+	}
+
+	// Block until a receiver makes room and takes the message from our buffer
+	currStackPtr->waitBuffer = (void *)item;
+	KernelBlockTimeout(&queue->senders, timeout);
+	// Leave the critical section
+	// The switch happens here and the thread resumes once the message is sent or the timeout ran out
+	KernelExitCritical(mask);
+
+	return !currStackPtr->waitTimedOut;
+}
+
+uint8_t MsgQueueReceive(msgqueue_t *queue, void *item, uint32_t timeout){
+	uint32_t mask;
+	uint8_t woken = 0;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(MsgQueueGet(queue, item, &woken)){
+		// Switch if a woken sender outranks the current thread
+		if(woken){
+			KernelPreempt();
+		}
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return 1;
+	}
+	if(timeout == 0){
+		// Empty and not allowed to wait
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return 0;
+	}
+
+	// Block until a sender copies its message straight into our buffer
+	currStackPtr->waitBuffer = item;
+	KernelBlockTimeout(&queue->receivers, timeout);
+	// Leave the critical section
+	// The switch happens here and the thread resumes with the message or after the timeout
+	KernelExitCritical(mask);
+
+	return !currStackPtr->waitTimedOut;
+}
+
+uint8_t MsgQueueSendFromISR(msgqueue_t *queue, const void *item, uint8_t *woken){
+	uint32_t mask;
+	uint8_t sent, readied = 0;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	sent = MsgQueuePut(queue, item, &readied);
+	// Leave the switch to KernelYieldFromISR, once per interrupt
+	if(readied && woken != 0 && KernelPreemptNeeded()){
+		*woken = 1;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return sent;
+}
+
+uint8_t MsgQueueReceiveFromISR(msgqueue_t *queue, void *item, uint8_t *woken){
+	uint32_t mask;
+	uint8_t received, readied = 0;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	received = MsgQueueGet(queue, item, &readied);
+	// Leave the switch to KernelYieldFromISR, once per interrupt
+	if(readied && woken != 0 && KernelPreemptNeeded()){
+		*woken = 1;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return received;
+}
+
+uint32_t MsgQueueCount(msgqueue_t *queue){
+	// A 32-bit aligned read is atomic on the Cortex-M4
+	return queue->count;
+}
+
+static uint8_t MsgQueuePut(msgqueue_t *queue, const void *item, uint8_t *woken){
+	// Must be called inside a critical section
+	tcb_t *receiver = queue->receivers.head;
+
+	if(receiver != 0){
+		// A receiver is waiting, so the ring is empty: copy straight into its buffer
+		memcpy(receiver->waitBuffer, item, queue->itemSize);
+		KernelWakeThread(receiver);
+		*woken = 1;
+		return 1;
+	}
+	if(queue->count == queue->capacity){
+		// Full
+		return 0;
+	}
+
+	// Append at the tail of the ring
+	memcpy(&queue->buffer[queue->tail * queue->itemSize], item, queue->itemSize);
+	if(++queue->tail == queue->capacity){
+		queue->tail = 0;
+	}
+	queue->count++;
+	return 1;
+}
+
+static uint8_t MsgQueueGet(msgqueue_t *queue, void *item, uint8_t *woken){
+	// Must be called inside a critical section
+	tcb_t *sender;
+
+	if(queue->count == 0){
+		// Empty
+		return 0;
+	}
+
+	// Take the oldest message from the head of the ring
+	memcpy(item, &queue->buffer[queue->head * queue->itemSize], queue->itemSize);
+	if(++queue->head == queue->capacity){
+		queue->head = 0;
+	}
+	queue->count--;
+
+	// The ring had been full, move the first blocked sender's message in behind the others
+	sender = queue->senders.head;
+	if(sender != 0){
+		memcpy(&queue->buffer[queue->tail * queue->itemSize], sender->waitBuffer, queue->itemSize);
+		if(++queue->tail == queue->capacity){
+			queue->tail = 0;
+		}
+		queue->count++;
+		KernelWakeThread(sender);
+		*woken = 1;
+	}
+	return 1;
+}
+
+uint8_t MpmcQueueInit(mpmcqueue_t *queue, void *buffer, uint32_t itemSize, uint32_t capacity){
+	uint32_t i;
+
+	// A slot's sequence number cannot tell full from empty with a single slot,
+	// and 0 slots would leave an all-ones index mask
+	if(capacity < 2){
+		return 0;
+	}
+
+	// Round the capacity down to a power of two, slot indices are masked instead of divided
+	while(capacity & (capacity - 1)){
+		capacity &= capacity - 1;
+	}
+
+	queue->buffer = (uint8_t *)buffer;
+	queue->itemSize = itemSize;
+	// Sequence number word followed by the item, padded to keep the next sequence number aligned
+	queue->stride = sizeof(uint32_t) + ((itemSize + 3) & ~3U);
+	queue->mask = capacity - 1;
+	queue->enqueuePos = 0;
+	queue->dequeuePos = 0;
+	// Slot i is free for the producer that claims position i
+	for(i = 0; i < capacity; i++){
+		*(volatile uint32_t *)&queue->buffer[i * queue->stride] = i;
+	}
+	// Nobody waiting yet
+	queue->receiversWaiting = 0;
+	queue->sendersWaiting = 0;
+	queue->receivers.head = 0;
+	queue->senders.head = 0;
+
+	return 1;
+}
+
+uint8_t MpmcQueueSend(mpmcqueue_t *queue, const void *item, uint32_t timeout){
+	if(MpmcQueuePush(queue, item)){
+		// Switch if a woken receiver outranks the current thread
+		if(MpmcQueueRelease(&queue->receivers, &queue->receiversWaiting)){
+			// Set PENDSVSET to 1 (Ref DUI0553 p4-14)
+			INT_CTRL = PENDSVSET;
+		}
+		return 1;
+	}
+	if(timeout == 0){
+		// Full and not allowed to wait
+		return 0;
+	}
+	return MpmcQueueWait(queue, (void *)item, timeout, 0);
+}
+
+uint8_t MpmcQueueReceive(mpmcqueue_t *queue, void *item, uint32_t timeout){
+	if(MpmcQueuePop(queue, item)){
+		// Switch if a woken sender outranks the current thread
+		if(MpmcQueueRelease(&queue->senders, &queue->sendersWaiting)){
+			// Set PENDSVSET to 1 (Ref DUI0553 p4-14)
+			INT_CTRL = PENDSVSET;
+		}
+		return 1;
+	}
+	if(timeout == 0){
+		// Empty and not allowed to wait
+		return 0;
+	}
+	return MpmcQueueWait(queue, item, timeout, 1);
+}
+
+uint8_t MpmcQueueSendFromISR(mpmcqueue_t *queue, const void *item, uint8_t *woken){
+	if(!MpmcQueuePush(queue, item)){
+		// Full
+		return 0;
+	}
+	// Leave the switch to KernelYieldFromISR, once per interrupt
+	if(MpmcQueueRelease(&queue->receivers, &queue->receiversWaiting) && woken != 0){
+		*woken = 1;
+	}
+	return 1;
+}
+
+uint8_t MpmcQueueReceiveFromISR(mpmcqueue_t *queue, void *item, uint8_t *woken){
+	if(!MpmcQueuePop(queue, item)){
+		// Empty
+		return 0;
+	}
+	// Leave the switch to KernelYieldFromISR, once per interrupt
+	if(MpmcQueueRelease(&queue->senders, &queue->sendersWaiting) && woken != 0){
+		*woken = 1;
+	}
+	return 1;
+}
+
+uint32_t MpmcQueueCount(mpmcqueue_t *queue){
+	uint32_t dequeuePos = queue->dequeuePos;
+	uint32_t count = queue->enqueuePos - dequeuePos;
+
+	// The two indices are read one after the other, a consumer may have run in between
+	return (int32_t)count < 0 ? 0 : (count > queue->mask + 1 ? queue->mask + 1 : count);
+}
+
+static uint8_t MpmcQueuePush(mpmcqueue_t *queue, const void *item){
+	uint32_t pos = queue->enqueuePos;
+	volatile uint32_t *slot;
+	int32_t diff;
+
+	while(1){
+		slot = (volatile uint32_t *)&queue->buffer[(pos & queue->mask) * queue->stride];
+		// The slot is free for position pos once the consumer of the previous lap released it
+		diff = (int32_t)(*slot - pos);
+		// Read the slot contents only after its sequence number
+		__DMB();
+		if(diff == 0){
+			// Free, claim the position before another producer does
+			if(MpmcQueueClaim(&queue->enqueuePos, pos)){
+				break;
+			}
+			pos = queue->enqueuePos;
+		}
+		else if(diff < 0){
+			// Still holds the item from the previous lap, the queue is full
+			return 0;
+		}
+		else{
+			// Another producer claimed it first, move on to the current position
+			pos = queue->enqueuePos;
+		}
+	}
+
+	// The slot is ours alone, copy the item in and publish it to the consumer of position pos
+	memcpy((void *)(slot + 1), item, queue->itemSize);
+	__DMB();
+	*slot = pos + 1;
+	return 1;
+}
+
+static uint8_t MpmcQueuePop(mpmcqueue_t *queue, void *item){
+	uint32_t pos = queue->dequeuePos;
+	volatile uint32_t *slot;
+	int32_t diff;
+
+	while(1){
+		slot = (volatile uint32_t *)&queue->buffer[(pos & queue->mask) * queue->stride];
+		// The slot holds the item of position pos once its producer published it
+		diff = (int32_t)(*slot - (pos + 1));
+		// Read the item only after its sequence number
+		__DMB();
+		if(diff == 0){
+			// Full, claim the position before another consumer does
+			if(MpmcQueueClaim(&queue->dequeuePos, pos)){
+				break;
+			}
+			pos = queue->dequeuePos;
+		}
+		else if(diff < 0){
+			// Not published yet, the queue is empty (or its producer was preempted mid-copy)
+			return 0;
+		}
+		else{
+			// Another consumer claimed it first, move on to the current position
+			pos = queue->dequeuePos;
+		}
+	}
+
+	// Copy the item out and hand the slot to the producer of the next lap
+	memcpy(item, (void *)(slot + 1), queue->itemSize);
+	__DMB();
+	*slot = pos + queue->mask + 1;
+	return 1;
+}
+
+static uint8_t MpmcQueueClaim(volatile uint32_t *index, uint32_t pos){
+	// Advance the index from pos with an exclusive store, fails if anyone moved it meanwhile
+	// An interrupt or context switch in between clears the exclusive monitor, the caller then retries
+	if(__LDREXW(index) != pos){
+		__CLREX();
+		return 0;
+	}
+	return __STREXW(pos + 1, index) == 0;
+}
+
+static uint8_t MpmcQueueWait(mpmcqueue_t *queue, void *item, uint32_t timeout, uint8_t receive){
+	uint32_t mask;
+	uint32_t start = KernelGetTicks();
+	uint32_t elapsed;
+	uint8_t done;
+	volatile uint32_t *waiting = receive ? &queue->receiversWaiting : &queue->sendersWaiting;
+	waitqueue_t *waiters = receive ? &queue->receivers : &queue->senders;
+
+	while(1){
+		// Enter a critical section
+		mask = KernelEnterCritical();
+		// Announce ourselves before the last try: a sender or receiver that finishes
+		// after this point sees us and wakes us, one that finished before is seen by the try
+		(*waiting)++;
+		__DMB();
+		done = receive ? MpmcQueuePop(queue, item) : MpmcQueuePush(queue, item);
+		if(!done){
+			// Block until the other side frees a slot or publishes an item
+			KernelBlockTimeout(waiters, timeout);
+		}
+		// Leave the critical section
+		// When blocking, the switch happens here and the thread resumes once woken or after the timeout
+		KernelExitCritical(mask);
+
+		// Enter a critical section
+		mask = KernelEnterCritical();
+		(*waiting)--;
+		// Leave the critical section
+		KernelExitCritical(mask);
+
+		if(done){
+			// Pass the slot we freed or the item we published on, as the fast paths do
+			if(receive ? MpmcQueueRelease(&queue->senders, &queue->sendersWaiting) : MpmcQueueRelease(&queue->receivers, &queue->receiversWaiting)){
+				// Set PENDSVSET to 1 (Ref DUI0553 p4-14)
+				INT_CTRL = PENDSVSET;
+			}
+			return 1;
+		}
+
+		// Woken, but another thread may have got there first: try again for the time left
+		if(currStackPtr->waitTimedOut){
+			return 0;
+		}
+		if(timeout != WAIT_FOREVER){
+			elapsed = KernelGetTicks() - start;
+			if(elapsed >= timeout){
+				return 0;
+			}
+			timeout -= elapsed;
+			start += elapsed;
+		}
+	}
+}
+
+static uint8_t MpmcQueueRelease(waitqueue_t *queue, volatile uint32_t *waiting){
+	uint32_t mask;
+	uint8_t preempt = 0;
+
+	// Order our slot update before the check, pairs with the barrier in MpmcQueueWait
+	__DMB();
+	// Lock-free when nobody waits, the common case
+	if(*waiting == 0){
+		return 0;
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	// The waiter may not have blocked yet, it then finds the slot in its last try
+	if(KernelWake(queue) != 0){
+		preempt = KernelPreemptNeeded();
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return preempt;
+}
+
+void MemPoolInit(mempool_t *pool, void *buffer, uint32_t blockSize, uint32_t blockCount){
+	uint32_t i;
+	uint8_t *block;
+
+	pool->buffer = (uint8_t *)buffer;
+	// Every block must hold the free list link and stay 8-byte aligned
+	pool->blockSize = MEMPOOL_BLOCK_SIZE(blockSize);
+	pool->blockCount = blockCount;
+
+	// Chain the blocks in address order, the first block is handed out first
+	pool->freeList = 0;
+	for(i = blockCount; i > 0; i--){
+		block = &pool->buffer[(i - 1) * pool->blockSize];
+		*(void **)block = pool->freeList;
+		pool->freeList = block;
+	}
+	pool->freeCount = blockCount;
+	pool->highWater = 0;
+	// Nobody waiting yet
+	pool->waiters.head = 0;
+}
+
+void *MemPoolAlloc(mempool_t *pool, uint32_t timeout){
+	uint32_t mask;
+	void *block;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	block = MemPoolTake(pool);
+	if(block != 0 || timeout == 0){
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return block;
+	}
+
+	// Block until MemPoolFree hands a block over through waitBuffer
+	currStackPtr->waitBuffer = 0;
+	KernelBlockTimeout(&pool->waiters, timeout);
+	// Leave the critical section
+	// The switch happens here and the thread resumes with a block or after the timeout
+	KernelExitCritical(mask);
+
+	return currStackPtr->waitTimedOut ? 0 : currStackPtr->waitBuffer;
+}
+
+void *MemPoolAllocFromISR(mempool_t *pool){
+	uint32_t mask;
+	void *block;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	block = MemPoolTake(pool);
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	return block;
+}
+
+void MemPoolFree(mempool_t *pool, void *block){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(MemPoolGive(pool, block)){
+		// Switch if the woken thread outranks the current one
+		KernelPreempt();
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+void MemPoolFreeFromISR(mempool_t *pool, void *block, uint8_t *woken){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	// Leave the switch to KernelYieldFromISR, once per interrupt
+	if(MemPoolGive(pool, block) && woken != 0 && KernelPreemptNeeded()){
+		*woken = 1;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+uint32_t MemPoolFreeCount(mempool_t *pool){
+	// A 32-bit aligned read is atomic on the Cortex-M4
+	return pool->freeCount;
+}
+
+uint32_t MemPoolHighWater(mempool_t *pool){
+	// A 32-bit aligned read is atomic on the Cortex-M4
+	return pool->highWater;
+}
+
+static void *MemPoolTake(mempool_t *pool){
+	// Must be called inside a critical section
+	void *block = pool->freeList;
+
+	if(block == 0){
+		// Empty
+		return 0;
+	}
+
+	// Pop the head of the free list, O(1)
+	pool->freeList = *(void **)block;
+	pool->freeCount--;
+	if(pool->blockCount - pool->freeCount > pool->highWater){
+		pool->highWater = pool->blockCount - pool->freeCount;
+	}
+	return block;
+}
+
+static uint8_t MemPoolGive(mempool_t *pool, void *block){
+	// Must be called inside a critical section
+	tcb_t *waiter = pool->waiters.head;
+
+	if(waiter != 0){
+		// The pool is empty and a thread is waiting, the block goes straight to it
+		waiter->waitBuffer = block;
+		KernelWakeThread(waiter);
+		return 1;
+	}
+
+	// Push on the head of the free list, O(1)
+	*(void **)block = pool->freeList;
+	pool->freeList = block;
+	pool->freeCount++;
+	return 0;
+}
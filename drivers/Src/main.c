@@ -2,23 +2,56 @@
 #include "led.h"
 #include "uart.h"
 #include "kernel.h"
+#include "ringbuf.h"
+#include "heap.h"
 
 #define QUANTA	10
+#define TASK3_PERIOD	100
+
+// Stack sizes in bytes, the printf threads need far more than the housekeeping loop
+#define TASK0_STACK_SIZE	128
+#define MOTOR_STACK_SIZE	768
+#define SAMPLER_STACK_SIZE	256
+
+// Size of the TIM2 sample ring in bytes, a power of two
+#define SAMPLE_RING_SIZE	256
+
+// Telemetry frames: sync bytes and payload length in front of a record of two words
+#define TELEMETRY_HEADER_SIZE	4
+#define TELEMETRY_RECORD_SIZE	(2 * sizeof(uint32_t))
+#define TELEMETRY_BUFFERS		4
 
 typedef uint32_t TaskProfiler;
 
 
 TaskProfiler Task0_Profiler = 0, Task1_Profiler = 0,Task2_Profiler = 0;
 TaskProfiler pTask1_Profiler = 0, pTask2_Profiler = 0;
-int32_t semaphore1,semaphore2;
+// The motor and valve threads take turns, each notifies the other when it is done
+tcb_t *motorThread, *valveThread;
+// Serializes printf on the UART between the motor and valve threads
+// Priority ceiling one level above both, so neither is time-sliced in while the other prints
+mutex_t uartMutex;
+// TIM2 timestamps streamed to the sampler thread
+RING_BUFFER(sampleStorage, SAMPLE_RING_SIZE);
+ringbuf_t sampleRing;
+tcb_t *samplerThread;
+// Buffers of the telemetry frames the sampler sends over the UART DMA
+IOBUF_POOL_BUFFER(telemetryStorage, TELEMETRY_HEADER_SIZE + TELEMETRY_RECORD_SIZE, TELEMETRY_BUFFERS);
+mempool_t telemetryPool;
+
+THREAD_STACK(task0_stack, TASK0_STACK_SIZE);
+THREAD_STACK(task1_stack, MOTOR_STACK_SIZE);
+THREAD_STACK(task2_stack, MOTOR_STACK_SIZE);
+THREAD_STACK(task4_stack, SAMPLER_STACK_SIZE);
 
 void motor_run(void);
 void motor_stop(void);
 void valve_open(void);
 void valve_close(void);
+void task3(void);
 
 
-void task0(void)
+void task0(void *arg)
 {  
 	while(1)
 	{
@@ -28,29 +61,29 @@ void task0(void)
 }
 
 
-void task1(void)
+void task1(void *arg)
 {
 	while(1)
 	{
-		SemaphoreWait(&semaphore1);
 		motor_run();
-//		Task1_Profiler++;
+		Task1_Profiler++;
 //		ThreadYield();
 //		valve_open();
-		SemaphoreGive(&semaphore2);
+		ThreadNotify(valveThread, 1, NOTIFY_SET_BITS);
+		ThreadNotifyWait(0xFFFFFFFF);
 	}
 }
 
-void task2(void)
+void task2(void *arg)
 {
 	while(1)
 	{
-		SemaphoreWait(&semaphore2);
+		ThreadNotifyWait(0xFFFFFFFF);
 		valve_open();
-//		Task2_Profiler++;
+		Task2_Profiler++;
 //		ThreadYield();
 //		motor_stop();
-		SemaphoreGive(&semaphore1);
+		ThreadNotify(motorThread, 1, NOTIFY_SET_BITS);
 	}
 }
 
@@ -58,19 +91,100 @@ void task3(void){
 	pTask1_Profiler++;
 }
 
+void telemetry_frame(iobuf_t *frame)
+{
+	uint8_t *header;
+	uint32_t length = IoBufChainLength(frame);
+
+	// Sync bytes and payload length, written in the headroom in front of the payload
+	header = IoBufPrepend(frame, TELEMETRY_HEADER_SIZE);
+	header[0] = 0xA5;
+	header[1] = 0x5A;
+	header[2] = (uint8_t)length;
+	header[3] = (uint8_t)(length >> 8);
+}
+
+void telemetry_send(uint32_t timestamp, uint32_t samples)
+{
+	iobuf_t *frame;
+	uint32_t *record;
+
+	// Drop the report rather than wait if the link is backed up
+	frame = IoBufAlloc(&telemetryPool, TELEMETRY_HEADER_SIZE, 0);
+	if(frame == 0)
+	{
+		return;
+	}
+	// The record is written once, in place, then framed and sent from the same buffer
+	record = (uint32_t *)IoBufAppend(frame, TELEMETRY_RECORD_SIZE);
+	record[0] = timestamp;
+	record[1] = samples;
+	telemetry_frame(frame);
+	// The UART driver frees the frame when the DMA is done with it
+	uart_send(frame);
+}
+
+void task4(void *arg)
+{
+	uint32_t length;
+	uint32_t samples, timestamp = 0;
+	uint8_t *data;
+
+	while(1)
+	{
+		// Sleep until TIM2 puts a sample in the empty ring
+		ThreadNotifyWait(0xFFFFFFFF);
+		// Drain the ring in place before sleeping again
+		samples = 0;
+		data = RingPeek(&sampleRing, &length);
+		while(length != 0)
+		{
+			samples += length / sizeof(uint32_t);
+			timestamp = *(uint32_t *)&data[length - sizeof(uint32_t)];
+			RingRelease(&sampleRing, length);
+			data = RingPeek(&sampleRing, &length);
+		}
+		pTask2_Profiler += samples;
+		// Report the latest timestamp and the batch size on the telemetry link
+		telemetry_send(timestamp, samples);
+	}
+}
+
+void sample_notify(void *arg)
+{
+	uint8_t woken = 0;
+
+	// Called from TIM2_IRQHandler, switch to the sampler on the way out
+	if(samplerThread != 0)
+	{
+		ThreadNotifyFromISR(samplerThread, 1, NOTIFY_SET_BITS, &woken);
+	}
+	KernelYieldFromISR(woken);
+}
+
 int main(void)
 {
 	// Initialize UART
 	uart_tx_init();
+	// Initialize the TIM2 sample ring before TIM2 can fill it
+	RingInit(&sampleRing, sampleStorage, sizeof(sampleStorage), &sample_notify, 0);
 	// Initialize TIM2
 	TIM2_1Hz_Interrupt_Init();
-	// Initialize Semaphore1 & Semaphore2
-	SemaphoreInit(&semaphore1, 1);
-	SemaphoreInit(&semaphore2, 0);
+	MutexInitCeiling(&uartMutex, DEFAULT_PRIORITY - 1);
+	IoBufPoolInit(&telemetryPool, telemetryStorage, TELEMETRY_HEADER_SIZE + TELEMETRY_RECORD_SIZE, TELEMETRY_BUFFERS);
 	/*Initialize Kernel*/
 	KernelInit();
-	/*Add Threads*/
-	KernelCreateThreads(&task0,&task1,&task2);
+	/*Add periodic jobs*/
+	KernelAddPeriodicJob(&task3, TASK3_PERIOD, PERIODIC_PHASE_AUTO);
+	/*Add Threads, the motor and valve threads preempt the housekeeping thread*/
+	ThreadCreate(&task0, 0, DEFAULT_PRIORITY + 1, task0_stack, sizeof(task0_stack));
+	motorThread = ThreadCreate(&task1, 0, DEFAULT_PRIORITY, task1_stack, sizeof(task1_stack));
+	valveThread = ThreadCreate(&task2, 0, DEFAULT_PRIORITY, task2_stack, sizeof(task2_stack));
+	samplerThread = ThreadCreate(&task4, 0, DEFAULT_PRIORITY - 2, task4_stack, sizeof(task4_stack));
+#if HEAP_PROFILE
+	/*Time malloc/free before the threads start allocating*/
+	HeapBenchmark();
+#endif
 
 	/*Set RoundRobin time quanta*/
 	KernelLaunch(QUANTA);
@@ -79,32 +193,48 @@ int main(void)
 }
 
 void TIM2_IRQHandler(void){
+	uint32_t length;
+	uint8_t *slot;
+
 	TIM2->SR &= ~(1 << 0);
-	pTask2_Profiler++;
+	// Timestamp the update event in place in the ring, dropped if the sampler fell behind
+	slot = RingReserve(&sampleRing, &length);
+	if(length >= sizeof(uint32_t)){
+		*(uint32_t *)slot = KernelGetTicks();
+		RingCommit(&sampleRing, sizeof(uint32_t));
+	}
 }
 
 
 void motor_run(void)
 {
+	MutexLock(&uartMutex);
 	printf("Motor is starting...\n\r");
+	MutexUnlock(&uartMutex);
 
 }
 
 
 void motor_stop(void)
 {
+	MutexLock(&uartMutex);
 	printf("Motor is stopping...\n\r");
+	MutexUnlock(&uartMutex);
 }
 
 void valve_open(void)
 {
+	MutexLock(&uartMutex);
 	printf("Valve is opening...\n\r");
+	MutexUnlock(&uartMutex);
 }
 
 
 void valve_close(void)
 {
+	MutexLock(&uartMutex);
 	printf("Valve is closing...\n\r");
+	MutexUnlock(&uartMutex);
 }
 
 
@@ -0,0 +1,77 @@
+#include "ringbuf.h"
+
+void RingInit(ringbuf_t *ring, uint8_t *buffer, uint32_t size, void (*notify)(void *arg), void *arg){
+	// Round the size down to a power of two, the indices are masked instead of divided
+	while(size & (size - 1)){
+		size &= size - 1;
+	}
+
+	ring->buffer = buffer;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->notify = notify;
+	ring->arg = arg;
+}
+
+uint8_t *RingReserve(ringbuf_t *ring, uint32_t *length){
+	uint32_t head = ring->head;
+	uint32_t offset = head & (ring->size - 1);
+	uint32_t space = ring->size - (head - ring->tail);
+
+	// Do not overwrite the released bytes before the consumer is done reading them
+	__DMB();
+
+	// Free space up to the end of the storage
+	if(space > ring->size - offset){
+		space = ring->size - offset;
+	}
+	*length = space;
+	return &ring->buffer[offset];
+}
+
+void RingCommit(ringbuf_t *ring, uint32_t length){
+	uint32_t head = ring->head;
+
+	if(length == 0){
+		return;
+	}
+
+	// Make the data visible before the new head
+	__DMB();
+	ring->head = head + length;
+	// Read the tail only after the head is published: either the consumer sees the new
+	// data before it goes to sleep, or we see that it had drained the ring and wake it
+	__DMB();
+	if(ring->tail == head && ring->notify != 0){
+		ring->notify(ring->arg);
+	}
+}
+
+uint8_t *RingPeek(ringbuf_t *ring, uint32_t *length){
+	uint32_t tail = ring->tail;
+	uint32_t offset = tail & (ring->size - 1);
+	uint32_t count = ring->head - tail;
+
+	// Read the data only after the head that covers it
+	__DMB();
+
+	// Data up to the end of the storage
+	if(count > ring->size - offset){
+		count = ring->size - offset;
+	}
+	*length = count;
+	return &ring->buffer[offset];
+}
+
+void RingRelease(ringbuf_t *ring, uint32_t length){
+	// Finish reading the data before the producer may reuse it
+	__DMB();
+	ring->tail += length;
+	// Publish the tail before the caller looks at the head again to decide to sleep
+	__DMB();
+}
+
+uint32_t RingCount(ringbuf_t *ring){
+	return ring->head - ring->tail;
+}
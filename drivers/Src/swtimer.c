@@ -0,0 +1,363 @@
+#include "swtimer.h"
+
+// Define the number of wheel levels and the slots per level
+// Each level covers 64 times the span of the one below: 64, 4096, 2^18 and 2^24 ticks
+#define WHEEL_LEVELS		4
+#define WHEEL_BITS			6
+#define WHEEL_SLOTS			(1U << WHEEL_BITS)
+#define WHEEL_MASK			(WHEEL_SLOTS - 1)
+
+// Level value of the timers taken out of the wheel and about to expire
+#define WHEEL_EXPIRING		WHEEL_LEVELS
+
+// Define the longest delay or period in ticks, later expiry times would look like past ones
+#define TIMER_MAX_TICKS		0x7FFFFFFFU
+
+// Slot lists of every level, each a NULL-terminated doubly linked list
+static swtimer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+
+// One bit per non-empty level 0 slot, finds the next expiry without scanning the slots
+static uint64_t level0Map = 0;
+
+// Number of timers sitting in levels 1 and up
+static uint32_t upperCount = 0;
+
+// Next tick the wheel has to process, lags KernelTicks while the service thread is busy
+static uint32_t wheelTime = 0;
+
+// Timers of the slot being processed, taken out of the wheel so that callbacks can rearm freely
+static swtimer_t *expireList = 0;
+
+// Timer-service thread and the tick it sleeps until
+THREAD_STACK(timerServiceStack, TIMER_SERVICE_STACK_SIZE);
+static tcb_t *serviceThread = 0;
+static uint32_t serviceWake = 0;
+static uint8_t serviceForever = 1;
+
+static void SoftTimerService(void *arg);
+static void WheelAdvance(void);
+static void WheelCascade(uint32_t level);
+static uint32_t WheelNextEvent(void);
+static uint32_t WheelBlocks(uint32_t expires, uint32_t shift);
+static void TimerLink(swtimer_t *timer, uint32_t level, uint32_t slot);
+static void TimerInsert(swtimer_t *timer);
+static void TimerUnlink(swtimer_t *timer);
+
+uint8_t SoftTimerServiceInit(void){
+	// Start the wheel at the current tick
+	wheelTime = KernelGetTicks();
+
+	// Callbacks run in this thread, at the priority of the application's choosing
+	serviceThread = ThreadCreate(&SoftTimerService, 0, TIMER_SERVICE_PRIORITY, timerServiceStack, sizeof(timerServiceStack));
+	return serviceThread != 0;
+}
+
+void SoftTimerInit(swtimer_t *timer, void (*callback)(void *arg), void *arg){
+	timer->nextPtr = 0;
+	timer->prevPtr = 0;
+	timer->expires = 0;
+	timer->period = 0;
+	timer->level = 0;
+	timer->slot = 0;
+	timer->active = 0;
+	timer->callback = callback;
+	timer->arg = arg;
+}
+
+void SoftTimerStart(swtimer_t *timer, uint32_t ticks, uint32_t period){
+	uint32_t mask;
+	uint8_t wake;
+
+	// An expiry in the current tick has already been missed, and a delay
+	// past TIMER_MAX_TICKS cannot be told apart from one in the past
+	if(ticks == 0){
+		ticks = 1;
+	}
+	if(ticks > TIMER_MAX_TICKS){
+		ticks = TIMER_MAX_TICKS;
+	}
+	if(period > TIMER_MAX_TICKS){
+		period = TIMER_MAX_TICKS;
+	}
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	// Restart from scratch if the timer is already armed
+	if(timer->active){
+		TimerUnlink(timer);
+	}
+	// The wheel stops turning while it is empty, bring it up to now so that the timer
+	// is placed from the right base and the service thread has no idle ticks to catch up
+	if(level0Map == 0 && upperCount == 0){
+		wheelTime = KernelGetTicks();
+	}
+	timer->expires = KernelGetTicks() + ticks;
+	timer->period = period;
+	timer->active = 1;
+	TimerInsert(timer);
+
+	// The service thread only has to look again if the timer expires before it wakes up
+	wake = serviceForever || (int32_t)(timer->expires - serviceWake) < 0;
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	// The service thread recomputes its sleep on its own after running the callbacks
+	if(wake && serviceThread != 0 && ThreadGetCurrent() != serviceThread){
+		ThreadWake(serviceThread);
+	}
+}
+
+void SoftTimerStop(swtimer_t *timer){
+	uint32_t mask;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+	if(timer->active){
+		TimerUnlink(timer);
+		timer->active = 0;
+	}
+	// Leave the critical section
+	KernelExitCritical(mask);
+}
+
+uint8_t SoftTimerIsActive(swtimer_t *timer){
+	return timer->active;
+}
+
+static void SoftTimerService(void *arg){
+	uint32_t ticks;
+
+	while(1){
+		// Process every tick up to now, one slot at a time
+		while((int32_t)(KernelGetTicks() - wheelTime) >= 0){
+			WheelAdvance();
+		}
+
+		// Sleep until the next slot with timers in it, or the next cascade
+		// A timer started meanwhile cuts the sleep short through ThreadWake
+		ticks = WheelNextEvent();
+		ThreadSleep(ticks);
+	}
+}
+
+static void WheelAdvance(void){
+	uint32_t mask;
+	uint32_t index;
+	swtimer_t *timer;
+	void (*callback)(void *arg);
+	void *arg;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	if(level0Map == 0 && upperCount == 0){
+		// Nothing armed, skip straight past the current tick
+		wheelTime = KernelGetTicks() + 1;
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return;
+	}
+
+	index = wheelTime & WHEEL_MASK;
+
+	// At the start of each level 0 round, move the timers of the matching
+	// upper level slot down, level by level like an odometer
+	if(index == 0){
+		WheelCascade(1);
+		if(((wheelTime >> WHEEL_BITS) & WHEEL_MASK) == 0){
+			WheelCascade(2);
+			if(((wheelTime >> (2 * WHEEL_BITS)) & WHEEL_MASK) == 0){
+				WheelCascade(3);
+			}
+		}
+	}
+
+	// Take the slot of this tick out of the wheel
+	expireList = wheel[0][index];
+	wheel[0][index] = 0;
+	level0Map &= ~(1ULL << index);
+	for(timer = expireList; timer != 0; timer = timer->nextPtr){
+		timer->level = WHEEL_EXPIRING;
+	}
+
+	// The tick is processed, timers started from the callbacks are placed after it
+	wheelTime++;
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	// Expire the timers one by one, a callback can stop or restart any of them
+	while(1){
+		// Enter a critical section
+		mask = KernelEnterCritical();
+		timer = expireList;
+		if(timer == 0){
+			// Leave the critical section
+			KernelExitCritical(mask);
+			break;
+		}
+		TimerUnlink(timer);
+		if(timer->period != 0){
+			// Rearm from the previous expiry so that the timer does not drift
+			timer->expires += timer->period;
+			TimerInsert(timer);
+		}
+		else{
+			timer->active = 0;
+		}
+		callback = timer->callback;
+		arg = timer->arg;
+		// Leave the critical section
+		KernelExitCritical(mask);
+
+		// Run the callback in thread context with interrupts enabled
+		callback(arg);
+	}
+}
+
+static void WheelCascade(uint32_t level){
+	// Must be called inside a critical section
+	// Costs one step per timer in the slot, each timer cascades at most once per level
+	uint32_t slot = (wheelTime >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	swtimer_t *timer = wheel[level][slot];
+	swtimer_t *next;
+
+	wheel[level][slot] = 0;
+	while(timer != 0){
+		next = timer->nextPtr;
+		upperCount--;
+		// The expiry is now within this level's span, it lands in a lower level
+		TimerInsert(timer);
+		timer = next;
+	}
+}
+
+static uint32_t WheelNextEvent(void){
+	uint32_t mask;
+	uint32_t now;
+	uint32_t index;
+	uint32_t ahead = 0xFFFFFFFF;
+	uint64_t map;
+
+	// Enter a critical section
+	mask = KernelEnterCritical();
+
+	index = wheelTime & WHEEL_MASK;
+	if(level0Map != 0){
+		// Rotate the current slot to bit 0, the lowest set bit is the next expiry
+		map = index ? (level0Map >> index) | (level0Map << (WHEEL_SLOTS - index)) : level0Map;
+		ahead = __builtin_ctzll(map);
+	}
+	if(upperCount != 0 && ((WHEEL_SLOTS - index) & WHEEL_MASK) < ahead){
+		// The next cascade may bring down a timer that expires earlier
+		ahead = (WHEEL_SLOTS - index) & WHEEL_MASK;
+	}
+
+	now = KernelGetTicks();
+	serviceForever = (ahead == 0xFFFFFFFF);
+	if(serviceForever){
+		// Nothing armed, sleep until SoftTimerStart wakes us up
+		// Leave the critical section
+		KernelExitCritical(mask);
+		return 0xFFFFFFFF;
+	}
+	serviceWake = wheelTime + ahead;
+
+	// Leave the critical section
+	KernelExitCritical(mask);
+
+	// A tick that came in meanwhile is due now, a zero sleep only yields
+	return (int32_t)(serviceWake - now) > 0 ? serviceWake - now : 0;
+}
+
+static uint32_t WheelBlocks(uint32_t expires, uint32_t shift){
+	// Number of 2^shift tick blocks from the wheel time to the expiry, wrap-around safe
+	return ((expires >> shift) - (wheelTime >> shift)) & (0xFFFFFFFFU >> shift);
+}
+
+static void TimerLink(swtimer_t *timer, uint32_t level, uint32_t slot){
+	// Must be called inside a critical section
+	// Push at the head of the slot list, O(1)
+	timer->level = level;
+	timer->slot = slot;
+	timer->prevPtr = 0;
+	timer->nextPtr = wheel[level][slot];
+	if(timer->nextPtr != 0){
+		timer->nextPtr->prevPtr = timer;
+	}
+	wheel[level][slot] = timer;
+
+	if(level == 0){
+		level0Map |= (1ULL << slot);
+	}
+	else{
+		upperCount++;
+	}
+}
+
+static void TimerInsert(swtimer_t *timer){
+	// Must be called inside a critical section
+	uint32_t expires = timer->expires;
+
+	// An expiry that is already past goes in the next slot processed
+	if((int32_t)(expires - wheelTime) < 0){
+		expires = wheelTime;
+	}
+
+	// Pick the lowest level whose span reaches the expiry, the slot is
+	// given by that level's bits of the expiry time
+	if(WheelBlocks(expires, 0) < WHEEL_SLOTS){
+		TimerLink(timer, 0, expires & WHEEL_MASK);
+	}
+	else if(WheelBlocks(expires, WHEEL_BITS) < WHEEL_SLOTS){
+		TimerLink(timer, 1, (expires >> WHEEL_BITS) & WHEEL_MASK);
+	}
+	else if(WheelBlocks(expires, 2 * WHEEL_BITS) < WHEEL_SLOTS){
+		TimerLink(timer, 2, (expires >> (2 * WHEEL_BITS)) & WHEEL_MASK);
+	}
+	else{
+		// Beyond the top level's span, park in its farthest slot
+		// The timer is placed again from its real expiry when that slot cascades
+		if(WheelBlocks(expires, 3 * WHEEL_BITS) >= WHEEL_SLOTS){
+			expires = wheelTime + (WHEEL_MASK << (3 * WHEEL_BITS));
+		}
+		TimerLink(timer, 3, (expires >> (3 * WHEEL_BITS)) & WHEEL_MASK);
+	}
+}
+
+static void TimerUnlink(swtimer_t *timer){
+	// Must be called inside a critical section
+	swtimer_t **head;
+
+	if(timer->level == WHEEL_EXPIRING){
+		head = &expireList;
+	}
+	else{
+		head = &wheel[timer->level][timer->slot];
+	}
+
+	// Unlink from the doubly linked slot list, O(1)
+	if(timer->prevPtr != 0){
+		timer->prevPtr->nextPtr = timer->nextPtr;
+	}
+	else{
+		*head = timer->nextPtr;
+	}
+	if(timer->nextPtr != 0){
+		timer->nextPtr->prevPtr = timer->prevPtr;
+	}
+	timer->nextPtr = 0;
+	timer->prevPtr = 0;
+
+	// Keep the level 0 bitmap and the upper level count in step
+	if(timer->level == 0){
+		if(wheel[0][timer->slot] == 0){
+			level0Map &= ~(1ULL << timer->slot);
+		}
+	}
+	else if(timer->level != WHEEL_EXPIRING){
+		upperCount--;
+	}
+}
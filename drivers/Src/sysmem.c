@@ -23,6 +23,7 @@
 /* Includes */
 #include <errno.h>
 #include <stdint.h>
+#include "heap.h"
 
 /**
  * Pointer to the current high watermark of the heap usage
@@ -35,37 +36,41 @@ static uint8_t *__sbrk_heap_end = NULL;
  *
  * @verbatim
  * ############################################################################
- * #  .data  #  .bss  #       newlib heap       #          MSP stack          #
- * #         #        #                         # Reserved by _Min_Stack_Size #
+ * #  .data  #  .bss  #     ._heap      #  ...  #          MSP stack          #
+ * #         #        #   _Heap_Size    #       # Reserved by _Min_Stack_Size #
  * ############################################################################
- * ^-- RAM start      ^-- _end                             _estack, RAM end --^
+ * ^-- RAM start      ^-- _sheap        ^-- _eheap         _estack, RAM end --^
  * @endverbatim
  *
- * This implementation starts allocating at the '_end' linker symbol
- * The '_Min_Stack_Size' linker symbol reserves a memory for the MSP stack
- * The implementation considers '_estack' linker symbol to be RAM end
- * NOTE: If the MSP stack, at any point during execution, grows larger than the
- * reserved size, please increase the '_Min_Stack_Size'.
+ * The heap region is reserved by the linker script between the '_sheap' and
+ * '_eheap' symbols. With HEAP_REPLACE_MALLOC (heap.h) the TLSF allocator in
+ * heap.c owns the whole region and serves malloc and free itself, so the
+ * break never moves and any call fails. Otherwise newlib's malloc grows
+ * inside the region through this function.
  *
  * @param incr Memory size
  * @return Pointer to allocated memory
  */
 void *_sbrk(ptrdiff_t incr)
 {
-  extern uint8_t _end; /* Symbol defined in the linker script */
-  extern uint8_t _estack; /* Symbol defined in the linker script */
-  extern uint32_t _Min_Stack_Size; /* Symbol defined in the linker script */
-  const uint32_t stack_limit = (uint32_t)&_estack - (uint32_t)&_Min_Stack_Size;
-  const uint8_t *max_heap = (uint8_t *)stack_limit;
+#if HEAP_REPLACE_MALLOC
+  /* The region belongs to the TLSF heap, newlib's malloc is not linked in */
+  (void)incr;
+  errno = ENOMEM;
+  return (void *)-1;
+#else
+  extern uint8_t _sheap; /* Symbol defined in the linker script */
+  extern uint8_t _eheap; /* Symbol defined in the linker script */
+  const uint8_t *max_heap = &_eheap;
   uint8_t *prev_heap_end;
 
   /* Initialize heap end at first call */
   if (NULL == __sbrk_heap_end)
   {
-    __sbrk_heap_end = &_end;
+    __sbrk_heap_end = &_sheap;
   }
 
-  /* Protect heap from growing into the reserved MSP stack */
+  /* Protect the memory past the heap region */
   if (__sbrk_heap_end + incr > max_heap)
   {
     errno = ENOMEM;
@@ -76,4 +81,5 @@ void *_sbrk(ptrdiff_t incr)
   __sbrk_heap_end += incr;
 
   return (void *)prev_heap_end;
+#endif
 }
@@ -21,15 +21,10 @@ void increment_tick(void) {
 }
 
 uint32_t get_tick(void) {
-	// Temporarily disable interrupts for atomic access
-	__disable_irq();
-
 	// Take a snapshot of the tick count
+	// A 32-bit aligned read is atomic on the Cortex-M4, no need to mask interrupts
 	g_current_tick_p = g_current_tick;
 
-	// Re-enable interrupts
-	__enable_irq();
-
 	// Return the snapshot
 	return g_current_tick_p;
 }
@@ -71,7 +66,8 @@ void timebase_init(void) {
     __enable_irq();
 }
 
-void SysTick_Handler(void) {
+// Weak so that the kernel can take over SysTick as its tick source
+__attribute__((weak)) void SysTick_Handler(void) {
 	// Increment the tick count on each SysTick interrupt
 	increment_tick();
 }
@@ -12,8 +12,15 @@
 #define APB1_CLOCK SYS_CLOCK
 #define UART_BAUDRATE 115200
 
+// Packets queued by uart_send, txHead is the one being sent
+static iobuf_t *txHead = 0, *txTail = 0;
+// Buffer the DMA is sending, 0 while the DMA is idle
+static iobuf_t * volatile txSegment = 0;
+
 int __io_putchar(int character);
 static void uart_write(int character);
+static void uart_queue(iobuf_t *packet, uint8_t *woken, uint8_t fromISR);
+static void uart_dma_next(iobuf_t *segment, uint8_t *woken, uint8_t fromISR);
 
 
 // Function to initialize UART2 TX
@@ -47,18 +54,150 @@ void uart_tx_init(void){
     // Enable UART module by setting the USART_CR2 USART enable (UE) register bit to 1 (bit 13)
     USART2->CR1 |= (1U << 13);
 
+    // Enable clock for DMA1 by setting the AHB1ENR register bit for DMA1 (bit 21)
+    RCC->AHB1ENR |= (1U << 21);
+
+    // Configure DMA1 stream 6 for USART2 TX:
+    // channel 4 (CHSEL bits 25-27), memory increment (MINC bit 10),
+    // memory to peripheral (DIR bits 6-7 = 0b01), transfer complete and transfer error interrupts (TCIE bit 4, TEIE bit 2)
+    DMA1_Stream6->CR = (4U << 25) | (1U << 10) | (1U << 6) | (1U << 4) | (1U << 2);
+    // The DMA writes every byte to the USART2 data register
+    DMA1_Stream6->PAR = (uint32_t)&USART2->DR;
+
+    // Let the USART request a byte from the DMA when TXE is set (DMAT bit 7 of USART_CR3)
+    USART2->CR3 |= (1U << 7);
+
+    // The DMA interrupt frees buffers, it needs a priority that kernel critical sections mask
+    NVIC_SetPriority(DMA1_Stream6_IRQn, KERNEL_MAX_SYSCALL_PRIORITY);
+    NVIC_EnableIRQ(DMA1_Stream6_IRQn);
+
+}
+
+// Function to queue a buffer chain for DMA transmission from a thread
+void uart_send(iobuf_t *packet) {
+    // An empty packet freed on the spot switches to a woken thread through MemPoolFree
+    uart_queue(packet, 0, 0);
+}
+
+// Function to queue a buffer chain for DMA transmission from an interrupt handler
+void uart_send_from_isr(iobuf_t *packet, uint8_t *woken) {
+    // Leave the switch to KernelYieldFromISR, once per interrupt
+    uart_queue(packet, woken, 1);
+}
+
+// Function to append a packet to the transmit queue
+static void uart_queue(iobuf_t *packet, uint8_t *woken, uint8_t fromISR) {
+    uint32_t mask;
+
+    // Enter a critical section, the DMA interrupt updates the same queue
+    mask = KernelEnterCritical();
+
+    // Append the packet to the transmit queue
+    packet->nextPacket = 0;
+    if (txTail != 0) {
+        txTail->nextPacket = packet;
+    }
+    else {
+        txHead = packet;
+    }
+    txTail = packet;
+
+    // Start the DMA if it is idle, otherwise the interrupt gets to the packet in turn
+    if (txSegment == 0) {
+        uart_dma_next(txHead, woken, fromISR);
+    }
+
+    // Leave the critical section
+    KernelExitCritical(mask);
+}
+
+// DMA1 stream 6 interrupt: the current buffer has been sent
+void DMA1_Stream6_IRQHandler(void) {
+    uint8_t woken = 0;
+
+    // Transfer complete (TCIF6 bit 21) or transfer error (TEIF6 bit 19) in the high interrupt status register
+    if (DMA1->HISR & ((1U << 21) | (1U << 19))) {
+        // Clear them by writing 1 to CTCIF6 and CTEIF6, a failed buffer is skipped rather than retried
+        DMA1->HIFCR = (1U << 21) | (1U << 19);
+        // A stale flag with no segment in flight has nothing to advance
+        if (txSegment != 0) {
+            uart_dma_next(txSegment->next, &woken, 1);
+        }
+    }
+
+    // Switch on the way out if a freed buffer woke a higher priority thread
+    KernelYieldFromISR(woken);
+}
+
+// Function to start the DMA on the next buffer with data
+// Must be called inside a critical section or from the DMA interrupt, with the DMA idle
+static void uart_dma_next(iobuf_t *segment, uint8_t *woken, uint8_t fromISR) {
+    iobuf_t *packet;
+
+    while (txHead != 0) {
+        // Skip empty buffers, the DMA cannot send 0 bytes
+        while (segment != 0 && segment->length == 0) {
+            segment = segment->next;
+        }
+        if (segment != 0) {
+            break;
+        }
+
+        // The whole packet has gone out, drop the driver's reference and move to the next one
+        packet = txHead;
+        txHead = packet->nextPacket;
+        if (txHead == 0) {
+            txTail = 0;
+        }
+        if (fromISR) {
+            IoBufFreeFromISR(packet, woken);
+        }
+        else {
+            IoBufFree(packet);
+        }
+        segment = txHead;
+    }
+
+    txSegment = segment;
+    if (segment == 0) {
+        // Nothing left to send, the DMA stays idle
+        return;
+    }
+
+    // Clear every stale stream 6 flag (bits 16, 18-21 of HIFCR) before enabling the stream
+    DMA1->HIFCR = (0x3DU << 16);
+    // Point the DMA straight at the payload, the bytes are not copied
+    DMA1_Stream6->M0AR = (uint32_t)segment->data;
+    DMA1_Stream6->NDTR = segment->length;
+    // Enable the stream by setting the EN bit (bit 0)
+    DMA1_Stream6->CR |= (1U << 0);
 }
 
 // Function to write a character via UART
 static void uart_write(int character) {
-    // Wait until the TX data register is empty
-    // The TXE (Transmit Data Register Empty) flag is bit 7 of the USART status register (USART_SR)
-    // When TXE is set, it indicates that the data register is ready for new data
-    while (!(USART2->SR & (1U << 7))) {}
+    uint32_t mask;
+
+    while (1) {
+        // Wait until the DMA has sent every queued packet
+        // and the TX data register is empty
+        // The TXE (Transmit Data Register Empty) flag is bit 7 of the USART status register (USART_SR)
+        // When TXE is set, it indicates that the data register is ready for new data
+        while (txSegment != 0 || !(USART2->SR & (1U << 7))) {}
+
+        // Check again with the DMA interrupt masked, uart_send may have started a packet meanwhile
+        mask = KernelEnterCritical();
+        if (txSegment == 0 && (USART2->SR & (1U << 7))) {
+            break;
+        }
+        KernelExitCritical(mask);
+    }
 
     // Write the 8-bit character to the USART2 data register
     // Masking with 0xFF ensures that only the lower 8 bits are written to the register
     USART2->DR = (character & 0xFF);
+
+    // Leave the critical section
+    KernelExitCritical(mask);
 }
 
 // Redirected I/O function for character output